@@ -0,0 +1,578 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <argp.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+#include "histogram.h"
+
+#define FRAME_LENGTH 16
+#define READ_LENGTH 64
+#define TYPING_BURST 20
+#define TYPING_PAUSE_NS 100000000L
+#define NODE_TIMEOUT_MS 5000
+#define MAX_DEVICES 1024
+
+const char *argp_program_version = "0.0.1";
+const char *argp_program_bug_address = "/dev/null";
+
+static char doc[] = "Synthetic load generator and benchmark for evdevkm.\n\n"
+	"Synthetic source devices are created through uinput and driven at a fixed"
+	" frame rate with the given pattern while evdevkm relays them. With several"
+	" devices the frames are spread round-robin over the devices to measure the"
+	" fan-in of many devices into one relay. The host and guest"
+	" nodes created by evdevkm are grabbed and read back to report throughput, CPU"
+	" time per event and the latency added by the relay. Arguments after '--' are"
+	" passed to evdevkm, which must create symlinks (no '-n')."
+	" Note that the source devices are not grabbed and are visible to the desktop; the"
+	" patterns are chosen to be harmless (pointer jitter in place and F13-F24).";
+
+static char args_doc[] = "[-- EVDEVKM_ARGS...]";
+
+static struct argp_option options[] = {
+	{ "binary", 'b', "PATH", 0, "Path of the evdevkm binary (default ./evdevkm)" },
+	{ "duration", 'd', "SECONDS", 0, "Duration of the load (default 5)" },
+	{ "pattern", 'p', "PATTERN", 0, "Load pattern: mouse, typing or multitouch (default mouse)" },
+	{ "rate", 'r', "HZ", 0, "Frames per second over all devices (default 8000)" },
+	{ "devices", 'n', "COUNT", 0, "Number of source devices (default 1)" },
+	{ "max-p99", 'm', "USEC", 0, "Exit with status 2 if the p99 latency exceeds USEC" },
+	{ 0 }
+};
+
+enum PATTERN {
+	mouse,
+	typing,
+	multitouch
+};
+
+struct Options {
+	char *binary;
+	double duration;
+	enum PATTERN pattern;
+	unsigned int rate;
+	unsigned int device_count;
+	double max_p99;
+	char **evdevkm_argv;
+	int evdevkm_argc;
+};
+
+struct Node {
+	char *label;
+	int fd;
+	unsigned long frames;
+	unsigned long events;
+	unsigned long dropped;
+	long seq;
+};
+
+struct Bench {
+	struct Options *options;
+	struct libevdev_uinput **sources;
+	const char **devnodes;
+
+	unsigned long frames;
+	unsigned long events;
+	long *send_time;
+	volatile bool done;
+
+	// the host and guest node of source `i` are `nodes[2 * i]` and `nodes[2 * i + 1]`
+	struct Node *nodes;
+	struct Histogram latency;
+	unsigned long lost;
+};
+
+long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void add_event(struct input_event *frame, int *n, unsigned int type, unsigned int code, int value) {
+	frame[*n].type = type;
+	frame[*n].code = code;
+	frame[*n].value = value;
+	(*n)++;
+}
+
+int create_source(struct Bench *bench, unsigned int index) {
+	int rc;
+	struct libevdev *dev;
+	struct input_absinfo abs = { .minimum = 0, .maximum = 4095, .resolution = 40 };
+	struct input_absinfo slot = { .minimum = 0, .maximum = 1 };
+	struct input_absinfo tracking = { .minimum = 0, .maximum = 65535 };
+
+	dev = libevdev_new();
+	if (dev == NULL) {
+		return -ENOMEM;
+	}
+
+	libevdev_set_name(dev, "evdevkm-bench");
+	libevdev_enable_event_type(dev, EV_MSC);
+	libevdev_enable_event_code(dev, EV_MSC, MSC_SCAN, NULL);
+
+	switch (bench->options->pattern) {
+		case mouse:
+			libevdev_enable_event_type(dev, EV_REL);
+			libevdev_enable_event_code(dev, EV_REL, REL_X, NULL);
+			libevdev_enable_event_code(dev, EV_REL, REL_Y, NULL);
+			libevdev_enable_event_type(dev, EV_KEY);
+			libevdev_enable_event_code(dev, EV_KEY, BTN_LEFT, NULL);
+			break;
+		case typing:
+			libevdev_enable_event_type(dev, EV_KEY);
+			for (unsigned int code = KEY_F13; code <= KEY_F24; code++) {
+				libevdev_enable_event_code(dev, EV_KEY, code, NULL);
+			}
+			break;
+		case multitouch:
+			libevdev_enable_event_type(dev, EV_KEY);
+			libevdev_enable_event_code(dev, EV_KEY, BTN_TOUCH, NULL);
+			libevdev_enable_event_code(dev, EV_KEY, BTN_TOOL_DOUBLETAP, NULL);
+			libevdev_enable_event_type(dev, EV_ABS);
+			libevdev_enable_event_code(dev, EV_ABS, ABS_X, &abs);
+			libevdev_enable_event_code(dev, EV_ABS, ABS_Y, &abs);
+			libevdev_enable_event_code(dev, EV_ABS, ABS_MT_SLOT, &slot);
+			libevdev_enable_event_code(dev, EV_ABS, ABS_MT_TRACKING_ID, &tracking);
+			libevdev_enable_event_code(dev, EV_ABS, ABS_MT_POSITION_X, &abs);
+			libevdev_enable_event_code(dev, EV_ABS, ABS_MT_POSITION_Y, &abs);
+			break;
+	}
+
+	rc = libevdev_uinput_create_from_device(dev, LIBEVDEV_UINPUT_OPEN_MANAGED, &bench->sources[index]);
+	libevdev_free(dev);
+	if (rc < 0) {
+		fprintf(stderr, "failed to create source device %u (%d)\n", index, rc);
+		return rc;
+	}
+
+	bench->devnodes[index] = libevdev_uinput_get_devnode(bench->sources[index]);
+	if (bench->devnodes[index] == NULL) {
+		fprintf(stderr, "failed to find node of source device %u\n", index);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+/**
+ * Build frame `seq` of the pattern. Every frame carries its sequence number as
+ * `MSC_SCAN` which is never filtered by the input core and is used to match
+ * relayed frames to the time they were sent.
+ *
+ * Frame `seq` is sent on source `seq % device_count`, the pattern runs on each
+ * source on its own frames.
+ */
+int build_frame(struct Bench *bench, struct input_event *frame, long frame_seq) {
+	int n = 0, x, y;
+	long count = bench->options->device_count;
+	long seq = frame_seq / count;
+	long last = (bench->frames - 1 - frame_seq % count) / count;
+
+	switch (bench->options->pattern) {
+		case mouse:
+			add_event(frame, &n, EV_REL, REL_X, seq % 2 ? 1 : -1);
+			add_event(frame, &n, EV_REL, REL_Y, seq % 2 ? 1 : -1);
+			break;
+		case typing:
+			// a keystroke is a press frame followed by a release frame
+			add_event(frame, &n, EV_KEY, KEY_F13 + (seq / 2) % 12, seq % 2 ? 0 : 1);
+			break;
+		case multitouch:
+			x = 1024 + seq % 2048;
+			y = 2048 - seq % 1024;
+			if (seq == 0) {
+				add_event(frame, &n, EV_KEY, BTN_TOUCH, 1);
+				add_event(frame, &n, EV_KEY, BTN_TOOL_DOUBLETAP, 1);
+			}
+			add_event(frame, &n, EV_ABS, ABS_MT_SLOT, 0);
+			add_event(frame, &n, EV_ABS, ABS_MT_TRACKING_ID, seq == last ? -1 : 1);
+			add_event(frame, &n, EV_ABS, ABS_MT_POSITION_X, x);
+			add_event(frame, &n, EV_ABS, ABS_MT_POSITION_Y, y);
+			add_event(frame, &n, EV_ABS, ABS_MT_SLOT, 1);
+			add_event(frame, &n, EV_ABS, ABS_MT_TRACKING_ID, seq == last ? -1 : 2);
+			add_event(frame, &n, EV_ABS, ABS_MT_POSITION_X, 4095 - x);
+			add_event(frame, &n, EV_ABS, ABS_MT_POSITION_Y, 4095 - y);
+			add_event(frame, &n, EV_ABS, ABS_X, x);
+			add_event(frame, &n, EV_ABS, ABS_Y, y);
+			if (seq == last) {
+				add_event(frame, &n, EV_KEY, BTN_TOUCH, 0);
+				add_event(frame, &n, EV_KEY, BTN_TOOL_DOUBLETAP, 0);
+			}
+			break;
+	}
+
+	add_event(frame, &n, EV_MSC, MSC_SCAN, (int) frame_seq);
+	add_event(frame, &n, EV_SYN, SYN_REPORT, 0);
+
+	return n;
+}
+
+void *generate(void *arg) {
+	struct Bench *bench = arg;
+	struct input_event frame[FRAME_LENGTH];
+	struct timespec next;
+	long period = 1000000000L / bench->options->rate;
+	unsigned int count = bench->options->device_count;
+	int n, fd;
+
+	memset(frame, 0, sizeof(frame));
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (long seq = 0; seq < bench->frames; seq++) {
+		next.tv_nsec += period;
+		if (bench->options->pattern == typing && seq > 0 && seq % (2 * TYPING_BURST * count) == 0) {
+			next.tv_nsec += TYPING_PAUSE_NS;
+		}
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		n = build_frame(bench, frame, seq);
+		fd = libevdev_uinput_get_fd(bench->sources[seq % count]);
+		bench->send_time[seq] = now_ns();
+		if (write(fd, frame, n * sizeof(struct input_event)) < 0) {
+			fprintf(stderr, "failed to write source frame %ld\n", seq);
+			break;
+		}
+		bench->events += n;
+	}
+
+	bench->done = true;
+
+	return NULL;
+}
+
+pid_t start_evdevkm(struct Options *options, const char **devnodes) {
+	pid_t pid;
+	char **argv;
+	int argc = 0;
+
+	argv = calloc(options->evdevkm_argc + options->device_count + 2, sizeof(char *));
+	if (argv == NULL) {
+		return -1;
+	}
+
+	argv[argc++] = options->binary;
+	for (int i = 0; i < options->evdevkm_argc; i++) {
+		argv[argc++] = options->evdevkm_argv[i];
+	}
+	for (unsigned int i = 0; i < options->device_count; i++) {
+		argv[argc++] = (char *) devnodes[i];
+	}
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid == 0) {
+		execv(options->binary, argv);
+		fprintf(stderr, "failed to execute %s\n", options->binary);
+		_exit(127);
+	}
+
+	free(argv);
+
+	return pid;
+}
+
+/**
+ * Open and grab the node created by evdevkm for `label` once its symlink appears.
+ */
+int open_node(struct Node *node, const char *devnode, char *label) {
+	char path[256], *name;
+	int clock = CLOCK_MONOTONIC;
+	char *copy = strdup(devnode);
+
+	name = basename(copy);
+	snprintf(path, sizeof(path), "/dev/input/by-path/%s-%s", name, label);
+	free(copy);
+
+	node->label = label;
+	node->seq = -1;
+
+	for (int waited = 0; waited < NODE_TIMEOUT_MS; waited += 10) {
+		node->fd = open(path, O_RDONLY|O_NONBLOCK);
+		if (node->fd >= 0) {
+			break;
+		}
+		usleep(10000);
+	}
+
+	if (node->fd < 0) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return -1;
+	}
+
+	if (ioctl(node->fd, EVIOCSCLOCKID, &clock) < 0 || ioctl(node->fd, EVIOCGRAB, 1) < 0) {
+		fprintf(stderr, "failed to set up %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+void read_node(struct Bench *bench, struct Node *node) {
+	struct input_event events[READ_LENGTH], *ev;
+	ssize_t n;
+	long latency;
+
+	while ((n = read(node->fd, events, sizeof(events))) > 0) {
+		for (size_t i = 0; i < n / sizeof(struct input_event); i++) {
+			ev = &events[i];
+			node->events++;
+
+			if (ev->type == EV_MSC && ev->code == MSC_SCAN) {
+				node->seq = ev->value;
+			} else if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+				node->dropped++;
+			} else if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+				node->frames++;
+				if (node->seq >= 0 && node->seq < (long) bench->frames) {
+					latency = ev->input_event_sec * 1000000000L + ev->input_event_usec * 1000L
+						- bench->send_time[node->seq];
+					histogram_record(&bench->latency, latency > 0 ? latency : 0);
+				}
+				node->seq = -1;
+			}
+		}
+	}
+}
+
+/**
+ * Time spent on the CPU by `pid` in nanoseconds.
+ */
+long cpu_time_ns(pid_t pid) {
+	char path[64];
+	long ns = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", pid);
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	if (fscanf(f, "%ld", &ns) != 1) {
+		ns = -1;
+	}
+
+	fclose(f);
+
+	return ns;
+}
+
+void report(struct Bench *bench, double seconds, long cpu_ns) {
+	unsigned long received = 0, frames = 0;
+	unsigned int count = bench->options->device_count;
+	struct Node total;
+
+	for (unsigned int i = 0; i < 2 * count; i++) {
+		received += bench->nodes[i].events;
+		frames += bench->nodes[i].frames;
+	}
+
+	printf("sent: %lu frames %lu events in %.2fs over %u devices\n", bench->frames, bench->events, seconds, count);
+
+	// the nodes of all devices are summed up by label
+	for (unsigned int j = 0; j < 2; j++) {
+		memset(&total, 0, sizeof(total));
+		for (unsigned int i = j; i < 2 * count; i += 2) {
+			total.frames += bench->nodes[i].frames;
+			total.events += bench->nodes[i].events;
+			total.dropped += bench->nodes[i].dropped;
+		}
+
+		printf("received %s: %lu frames %lu events %lu dropped\n",
+			bench->nodes[j].label,
+			total.frames,
+			total.events,
+			total.dropped);
+	}
+
+	printf("lost frames: %lu\n", bench->frames > frames ? bench->frames - frames : 0);
+	printf("throughput: %.0f events/s\n", received / seconds);
+
+	if (cpu_ns >= 0 && received > 0) {
+		printf("cpu: %.3fs %.3fus/event\n", cpu_ns / 1e9, cpu_ns / 1000.0 / received);
+	}
+
+	if (bench->latency.count > 0) {
+		printf("latency: p50 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+			histogram_percentile(&bench->latency, 50.0) / 1000.0,
+			histogram_percentile(&bench->latency, 99.0) / 1000.0,
+			histogram_percentile(&bench->latency, 99.9) / 1000.0,
+			bench->latency.max / 1000.0);
+	}
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct Options *options = state->input;
+
+	switch (key) {
+		case 'b':
+			options->binary = arg;
+			break;
+		case 'd':
+			options->duration = strtod(arg, NULL);
+			if (options->duration <= 0) {
+				argp_error(state, "%s is not a valid duration", arg);
+			}
+			break;
+		case 'p':
+			if (strcmp(arg, "mouse") == 0) {
+				options->pattern = mouse;
+			} else if (strcmp(arg, "typing") == 0) {
+				options->pattern = typing;
+			} else if (strcmp(arg, "multitouch") == 0) {
+				options->pattern = multitouch;
+			} else {
+				argp_error(state, "%s is not a valid pattern", arg);
+			}
+			break;
+		case 'r':
+			options->rate = strtoul(arg, NULL, 10);
+			if (options->rate == 0 || options->rate > 1000000) {
+				argp_error(state, "%s is not a valid rate", arg);
+			}
+			break;
+		case 'n':
+			options->device_count = strtoul(arg, NULL, 10);
+			if (options->device_count == 0 || options->device_count > MAX_DEVICES) {
+				argp_error(state, "%s is not a valid number of devices (1-%d)", arg, MAX_DEVICES);
+			}
+			break;
+		case 'm':
+			options->max_p99 = strtod(arg, NULL);
+			break;
+		case ARGP_KEY_ARGS:
+			options->evdevkm_argv = state->argv + state->next;
+			options->evdevkm_argc = state->argc - state->next;
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+int main(int argc, char **argv) {
+	int rc, epfd, nfds, status = 0;
+	pid_t pid;
+	long cpu_before, cpu_after, start, stop;
+	unsigned int count;
+	pthread_t generator;
+	struct epoll_event ev, events[READ_LENGTH];
+	struct Options options = {
+		.binary = "./evdevkm",
+		.duration = 5.0,
+		.pattern = mouse,
+		.rate = 8000,
+		.device_count = 1,
+		.max_p99 = 0,
+		.evdevkm_argv = NULL,
+		.evdevkm_argc = 0,
+	};
+	static struct Bench bench;
+
+	argp_parse(&argp, argc, argv, 0, 0, &options);
+
+	count = options.device_count;
+
+	bench.options = &options;
+	bench.frames = (unsigned long) (options.duration * options.rate);
+	bench.send_time = calloc(bench.frames, sizeof(long));
+	bench.sources = calloc(count, sizeof(struct libevdev_uinput *));
+	bench.devnodes = calloc(count, sizeof(char *));
+	bench.nodes = calloc(2 * count, sizeof(struct Node));
+	if (bench.send_time == NULL || bench.sources == NULL || bench.devnodes == NULL || bench.nodes == NULL) {
+		exit(1);
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (create_source(&bench, i) < 0) {
+			exit(1);
+		}
+	}
+
+	pid = start_evdevkm(&options, bench.devnodes);
+	if (pid < 0) {
+		exit(1);
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (open_node(&bench.nodes[2 * i], bench.devnodes[i], "host") < 0
+				|| open_node(&bench.nodes[2 * i + 1], bench.devnodes[i], "guest") < 0) {
+			kill(pid, SIGTERM);
+			exit(1);
+		}
+	}
+
+	epfd = epoll_create1(0);
+	for (unsigned int i = 0; i < 2 * count; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &bench.nodes[i];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, bench.nodes[i].fd, &ev);
+	}
+
+	cpu_before = cpu_time_ns(pid);
+	start = now_ns();
+
+	rc = pthread_create(&generator, NULL, generate, &bench);
+	if (rc != 0) {
+		fprintf(stderr, "failed to start generator\n");
+		kill(pid, SIGTERM);
+		exit(1);
+	}
+
+	// keep reading until the generator is done and the relay has been idle for a while
+	while (true) {
+		nfds = epoll_wait(epfd, events, READ_LENGTH, 200);
+		if (nfds == 0 && bench.done) {
+			break;
+		}
+
+		for (int n = 0; n < nfds; n++) {
+			read_node(&bench, events[n].data.ptr);
+		}
+	}
+
+	pthread_join(generator, NULL);
+	stop = now_ns() - 200000000L;
+
+	cpu_after = cpu_time_ns(pid);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	report(&bench, (stop - start) / 1e9, cpu_before < 0 || cpu_after < 0 ? -1 : cpu_after - cpu_before);
+
+	if (options.max_p99 > 0 && histogram_percentile(&bench.latency, 99.0) / 1000.0 > options.max_p99) {
+		fprintf(stderr, "p99 latency exceeds %.1fus\n", options.max_p99);
+		status = 2;
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		libevdev_uinput_destroy(bench.sources[i]);
+	}
+	close(epfd);
+
+	return status;
+}
@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <argp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <libevdev/libevdev.h>
+
+#include "tap.h"
+
+#define IDLE_NS 100000L
+#define REPORT_INTERVAL_NS 1000000000L
+#define MAX_CONSUMERS 16
+
+const char *argp_program_version = "0.0.1";
+const char *argp_program_bug_address = "/dev/null";
+
+static char doc[] = "Sample consumer of the evdevkm tap.\n\n"
+	"The memfd of the tap is requested on the control socket of evdevkm, which must"
+	" run with '--control=SOCKET --tap', and mapped read-only. Every relayed frame is"
+	" printed with its sequence number, device index and target, or with '-t' only"
+	" the frames per second and the frames lost by falling behind are printed."
+	" With '-b' no evdevkm is needed: a producer thread publishes FRAMES synthetic"
+	" frames to a private ring, as fast as possible or at '-r', while '-c' consumer"
+	" threads read it, to measure the throughput of the ring itself.";
+
+static char args_doc[] = "[SOCKET]";
+
+static struct argp_option options[] = {
+	{ "throughput", 't', 0, 0, "Print frames per second instead of the frames" },
+	{ "bench", 'b', "FRAMES", 0, "Measure the throughput of a private ring with FRAMES frames" },
+	{ "consumers", 'c', "COUNT", 0, "Consumer threads for '-b' (default 1)" },
+	{ "capacity", 'n', "FRAMES", 0, "Capacity of the private ring for '-b' (default 4096)" },
+	{ "rate", 'r', "HZ", 0, "Frames per second published for '-b' (default as fast as possible)" },
+	{ 0 }
+};
+
+struct Options {
+	char *socket_path;
+	bool throughput;
+	unsigned long bench_frames;
+	unsigned int consumers;
+	unsigned int capacity;
+	unsigned long rate;
+};
+
+struct Consumer {
+	struct TapHeader *tap;
+	pthread_t thread;
+	uint64_t seq;
+	unsigned long frames;
+	unsigned long events;
+	uint64_t lost;
+	volatile bool *done;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+void handle_signal(int signal) {
+	stop = 1;
+}
+
+long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void idle() {
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = IDLE_NS };
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * Request the memfd of the tap on the control socket and map it read-only.
+ */
+struct TapHeader *tap_connect(char *path) {
+	int sock, fd = -1;
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	char reply[256];
+	ssize_t n;
+	struct TapHeader header, *tap;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n", path);
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "failed to connect to %s\n", path);
+		return NULL;
+	}
+
+	if (send(sock, "tap", 3, 0) < 0) {
+		fprintf(stderr, "failed to request the tap\n");
+		close(sock);
+		return NULL;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(reply) - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buffer;
+	msg.msg_controllen = sizeof(u.buffer);
+
+	n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	close(sock);
+	if (n <= 0) {
+		fprintf(stderr, "failed to receive the tap\n");
+		return NULL;
+	}
+	reply[n] = '\0';
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	if (fd < 0) {
+		fprintf(stderr, "no tap received: %s", reply);
+		return NULL;
+	}
+
+	// the capacity is only known once the header is read
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+			|| header.magic != TAP_MAGIC || header.version != TAP_VERSION
+			|| header.slot_size != sizeof(struct TapSlot)) {
+		fprintf(stderr, "tap has an unknown format\n");
+		close(fd);
+		return NULL;
+	}
+
+	tap = mmap(NULL, tap_size(header.capacity), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tap == MAP_FAILED) {
+		fprintf(stderr, "failed to map the tap\n");
+		return NULL;
+	}
+
+	return tap;
+}
+
+void print_frame(struct TapHeader *tap, struct TapSlot *frame) {
+	struct input_event *ev;
+	const char *name;
+
+	printf("%lu device %u %s:", (unsigned long) frame->seq, frame->device,
+		frame->target < tap->target_count ? tap->targets[frame->target] : "?");
+
+	for (unsigned int i = 0; i < frame->length; i++) {
+		ev = &frame->events[i];
+		if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+			continue;
+		}
+		name = libevdev_event_code_get_name(ev->type, ev->code);
+		if (name != NULL) {
+			printf(" %s %d", name, ev->value);
+		} else {
+			printf(" %u:%u %d", ev->type, ev->code, ev->value);
+		}
+	}
+
+	if (frame->frame_length > frame->length) {
+		printf(" (%u more events cut off)", frame->frame_length - frame->length);
+	}
+
+	printf("\n");
+}
+
+int consume(struct TapHeader *tap, bool throughput) {
+	struct TapSlot frame;
+	uint64_t seq, lost = 0, reported_lost = 0;
+	unsigned long frames = 0;
+	long reported = now_ns(), now;
+
+	// start with the next frame instead of replaying the ring
+	seq = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+
+	while (!stop) {
+		switch (tap_read(tap, &seq, &frame, &lost)) {
+			case tap_read_frame:
+				frames++;
+				if (!throughput) {
+					print_frame(tap, &frame);
+				}
+				continue;
+			case tap_read_lost:
+				continue;
+			case tap_read_empty:
+				break;
+		}
+
+		fflush(stdout);
+		idle();
+
+		now = now_ns();
+		if (throughput && now - reported >= REPORT_INTERVAL_NS) {
+			printf("%.0f frames/s %lu lost\n", frames * 1e9 / (now - reported), (unsigned long) (lost - reported_lost));
+			frames = 0;
+			reported = now;
+			reported_lost = lost;
+		}
+	}
+
+	return 0;
+}
+
+void *bench_consume(void *arg) {
+	struct Consumer *c = arg;
+	struct TapSlot frame;
+
+	while (true) {
+		switch (tap_read(c->tap, &c->seq, &frame, &c->lost)) {
+			case tap_read_frame:
+				c->frames++;
+				c->events += frame.length;
+				continue;
+			case tap_read_lost:
+				continue;
+			case tap_read_empty:
+				break;
+		}
+
+		if (__atomic_load_n(c->done, __ATOMIC_ACQUIRE)
+				&& c->seq == __atomic_load_n(&c->tap->head, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Publish synthetic mouse frames to a private ring at `options->rate`, or as fast
+ * as possible, and read them back with `consumers` threads.
+ */
+int bench(struct Options *options) {
+	struct TapHeader *tap;
+	struct Consumer consumers[MAX_CONSUMERS];
+	struct input_event frame[3];
+	volatile bool done = false;
+	long start, end;
+
+	tap = mmap(NULL, tap_size(options->capacity), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (tap == MAP_FAILED) {
+		fprintf(stderr, "failed to map the ring\n");
+		return -1;
+	}
+
+	tap_init(tap, options->capacity);
+
+	memset(frame, 0, sizeof(frame));
+	frame[0].type = EV_REL;
+	frame[0].code = REL_X;
+	frame[1].type = EV_REL;
+	frame[1].code = REL_Y;
+	frame[2].type = EV_SYN;
+	frame[2].code = SYN_REPORT;
+
+	for (unsigned int i = 0; i < options->consumers; i++) {
+		memset(&consumers[i], 0, sizeof(struct Consumer));
+		consumers[i].tap = tap;
+		consumers[i].done = &done;
+		if (pthread_create(&consumers[i].thread, NULL, bench_consume, &consumers[i]) != 0) {
+			fprintf(stderr, "failed to start consumer\n");
+			return -1;
+		}
+	}
+
+	start = now_ns();
+
+	for (unsigned long seq = 0; seq < options->bench_frames; seq++) {
+		// spin instead of sleeping to keep the rate accurate
+		while (options->rate > 0 && (now_ns() - start) * options->rate < seq * 1000000000UL);
+
+		frame[0].value = seq % 2 ? 1 : -1;
+		frame[1].value = seq % 2 ? 1 : -1;
+		tap_publish(tap, seq, options->capacity, 0, 0, frame, 3);
+	}
+
+	end = now_ns();
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+
+	printf("published: %lu frames in %.3fs, %.0f frames/s\n",
+		options->bench_frames, (end - start) / 1e9, options->bench_frames * 1e9 / (end - start));
+
+	for (unsigned int i = 0; i < options->consumers; i++) {
+		pthread_join(consumers[i].thread, NULL);
+		printf("consumer %u: %lu frames %lu events %lu lost\n",
+			i, consumers[i].frames, consumers[i].events, (unsigned long) consumers[i].lost);
+	}
+
+	munmap(tap, tap_size(options->capacity));
+
+	return 0;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct Options *options = state->input;
+
+	switch (key) {
+		case 't':
+			options->throughput = true;
+			break;
+		case 'b':
+			options->bench_frames = strtoul(arg, NULL, 10);
+			if (options->bench_frames == 0) {
+				argp_error(state, "%s is not a valid number of frames", arg);
+			}
+			break;
+		case 'c':
+			options->consumers = strtoul(arg, NULL, 10);
+			if (options->consumers == 0 || options->consumers > MAX_CONSUMERS) {
+				argp_error(state, "%s is not a valid number of consumers", arg);
+			}
+			break;
+		case 'n':
+			options->capacity = strtoul(arg, NULL, 10);
+			if (options->capacity == 0 || (options->capacity & (options->capacity - 1)) != 0) {
+				argp_error(state, "%s is not a power of two", arg);
+			}
+			break;
+		case 'r':
+			options->rate = strtoul(arg, NULL, 10);
+			if (options->rate == 0) {
+				argp_error(state, "%s is not a valid rate", arg);
+			}
+			break;
+		case ARGP_KEY_ARG:
+			if (options->socket_path != NULL) {
+				argp_usage(state);
+			}
+			options->socket_path = arg;
+			break;
+		case ARGP_KEY_END:
+			if (options->socket_path == NULL && options->bench_frames == 0) {
+				argp_usage(state);
+			}
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+int main(int argc, char **argv) {
+	struct TapHeader *tap;
+	struct Options options = {
+		.socket_path = NULL,
+		.throughput = false,
+		.bench_frames = 0,
+		.consumers = 1,
+		.capacity = 4096,
+		.rate = 0,
+	};
+
+	argp_parse(&argp, argc, argv, 0, 0, &options);
+
+	if (options.bench_frames > 0) {
+		return bench(&options) < 0 ? 1 : 0;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	tap = tap_connect(options.socket_path);
+	if (tap == NULL) {
+		return 1;
+	}
+
+	consume(tap, options.throughput);
+
+	return 0;
+}
@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
+#include <poll.h>
+#include <argp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <libevdev/libevdev.h>
+
+#include "vhost_user.h"
+
+#define MEMORY_SIZE (1024 * 1024)
+#define EVENTQ_OFFSET 0
+#define STATUSQ_OFFSET (256 * 1024)
+#define BUFFERS_OFFSET (512 * 1024)
+#define STATUSQ_SIZE 8
+#define BITMAP_SIZE 128
+
+const char *argp_program_version = "0.0.1";
+const char *argp_program_bug_address = "/dev/null";
+
+static char doc[] = "Stand-in vhost-user frontend for evdevkm.\n\n"
+	"Connects to the socket of a vhost-user target of evdevkm and drives it like a"
+	" virtual machine would: the guest memory is a memfd, the event queue is filled"
+	" with buffers and the config space is queried for the capabilities of the device."
+	" Every event written to the queue is validated against the capabilities and"
+	" the frame structure, the exit status is 1 if an event was invalid.";
+
+static char args_doc[] = "SOCKET";
+
+static struct argp_option options[] = {
+	{ "frames", 'n', "FRAMES", 0, "Exit after FRAMES frames (default run until interrupted)" },
+	{ "timeout", 't', "SECONDS", 0, "Exit after SECONDS without events" },
+	{ "queue-size", 'q', "SIZE", 0, "Size of the event queue (default 64)" },
+	{ "verbose", 'v', 0, 0, "Print every frame" },
+	{ 0 }
+};
+
+struct Options {
+	char *socket_path;
+	unsigned long frames;
+	int timeout_ms;
+	unsigned int queue_size;
+	bool verbose;
+};
+
+struct Ring {
+	unsigned int num;
+	uint64_t offset;
+	struct vring vring;
+	uint16_t avail_idx;
+	uint16_t last_used;
+	int kick_fd;
+	int call_fd;
+};
+
+struct Client {
+	struct Options *options;
+	int fd;
+	int memory_fd;
+	char *memory;
+	uint64_t protocol_features;
+	struct Ring rings[VHOST_INPUT_QUEUES];
+
+	char name[BITMAP_SIZE + 1];
+	uint8_t bits[EV_CNT][BITMAP_SIZE];
+	struct virtio_input_absinfo abs[ABS_CNT];
+
+	unsigned long frames;
+	unsigned long events;
+	unsigned long errors;
+	unsigned int frame_length;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+void handle_signal(int signal) {
+	stop = 1;
+}
+
+int send_message(struct Client *c, uint32_t request, void *payload, uint32_t size, int *fds, unsigned int fd_count) {
+	struct VhostUserMessage msg;
+	struct msghdr hdr;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buffer[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.request = request;
+	msg.flags = VHOST_USER_VERSION;
+	msg.size = size;
+	if (size > 0) {
+		memcpy(&msg.payload, payload, size);
+	}
+
+	// ask for an acknowledgement of everything that has no reply of its own
+	if ((c->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))
+			&& request != VHOST_USER_GET_FEATURES && request != VHOST_USER_GET_PROTOCOL_FEATURES
+			&& request != VHOST_USER_GET_CONFIG && request != VHOST_USER_GET_VRING_BASE) {
+		msg.flags |= VHOST_USER_NEED_REPLY_MASK;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = &msg;
+	iov.iov_len = VHOST_USER_HEADER_SIZE + size;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	if (fd_count > 0) {
+		hdr.msg_control = u.buffer;
+		hdr.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+	}
+
+	if (sendmsg(c->fd, &hdr, MSG_NOSIGNAL) < 0) {
+		fprintf(stderr, "failed to send request %u\n", request);
+		return -errno;
+	}
+
+	if (msg.flags & VHOST_USER_NEED_REPLY_MASK) {
+		if (recv(c->fd, &msg, VHOST_USER_HEADER_SIZE + sizeof(uint64_t), MSG_WAITALL)
+				!= VHOST_USER_HEADER_SIZE + sizeof(uint64_t) || msg.payload.u64 != 0) {
+			fprintf(stderr, "request %u was not acknowledged\n", request);
+			return -EPROTO;
+		}
+	}
+
+	return 0;
+}
+
+int receive_reply(struct Client *c, uint32_t request, struct VhostUserMessage *msg) {
+	if (recv(c->fd, msg, VHOST_USER_HEADER_SIZE, MSG_WAITALL) != VHOST_USER_HEADER_SIZE
+			|| msg->request != request || !(msg->flags & VHOST_USER_REPLY_MASK)
+			|| msg->size > sizeof(msg->payload)
+			|| (msg->size > 0 && recv(c->fd, &msg->payload, msg->size, MSG_WAITALL) != (ssize_t) msg->size)) {
+		fprintf(stderr, "invalid reply to request %u\n", request);
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+int get_u64(struct Client *c, uint32_t request, uint64_t *value) {
+	int rc;
+	struct VhostUserMessage msg;
+
+	rc = send_message(c, request, NULL, 0, NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = receive_reply(c, request, &msg);
+	if (rc < 0) {
+		return rc;
+	}
+
+	memcpy(value, &msg.payload.u64, sizeof(uint64_t));
+
+	return 0;
+}
+
+/**
+ * Select a part of the config space and read it back, as QEMU does for the driver.
+ */
+int query_config(struct Client *c, uint8_t select, uint8_t subsel, struct virtio_input_config *config) {
+	int rc;
+	struct VhostUserConfig request;
+	struct VhostUserMessage msg;
+	uint32_t size = offsetof(struct VhostUserConfig, region) + sizeof(struct virtio_input_config);
+
+	memset(&request, 0, sizeof(request));
+	request.offset = 0;
+	request.size = sizeof(struct virtio_input_config);
+	((struct virtio_input_config *) request.region)->select = select;
+	((struct virtio_input_config *) request.region)->subsel = subsel;
+
+	rc = send_message(c, VHOST_USER_SET_CONFIG, &request, size, NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	memset(request.region, 0, sizeof(request.region));
+	rc = send_message(c, VHOST_USER_GET_CONFIG, &request, size, NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = receive_reply(c, VHOST_USER_GET_CONFIG, &msg);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (msg.size != size) {
+		fprintf(stderr, "config reply has size %u\n", msg.size);
+		return -EPROTO;
+	}
+
+	memcpy(config, msg.payload.config.region, sizeof(struct virtio_input_config));
+
+	if (config->size > sizeof(config->u)) {
+		fprintf(stderr, "config of select %u subsel %u has size %u\n", select, subsel, config->size);
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+int read_capabilities(struct Client *c) {
+	int rc;
+	struct virtio_input_config config;
+
+	rc = query_config(c, VIRTIO_INPUT_CFG_ID_NAME, 0, &config);
+	if (rc < 0) {
+		return rc;
+	}
+	memcpy(c->name, config.u.string, config.size);
+	c->name[config.size] = '\0';
+
+	for (unsigned int type = 1; type < EV_CNT; type++) {
+		rc = query_config(c, VIRTIO_INPUT_CFG_EV_BITS, type, &config);
+		if (rc < 0) {
+			return rc;
+		}
+		memcpy(c->bits[type], config.u.bitmap, config.size);
+	}
+
+	for (unsigned int code = 0; code < ABS_CNT; code++) {
+		if (!(c->bits[EV_ABS][code / 8] & (1 << (code % 8)))) {
+			continue;
+		}
+
+		rc = query_config(c, VIRTIO_INPUT_CFG_ABS_INFO, code, &config);
+		if (rc < 0) {
+			return rc;
+		}
+		if (config.size != sizeof(config.u.abs)) {
+			fprintf(stderr, "no abs info for %u\n", code);
+			return -EPROTO;
+		}
+		c->abs[code] = config.u.abs;
+	}
+
+	return 0;
+}
+
+int create_memory(struct Client *c) {
+	c->memory_fd = memfd_create("evdevkm-vhost-client", MFD_CLOEXEC);
+	if (c->memory_fd < 0 || ftruncate(c->memory_fd, MEMORY_SIZE) < 0) {
+		fprintf(stderr, "failed to create guest memory\n");
+		return -1;
+	}
+
+	c->memory = mmap(NULL, MEMORY_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, c->memory_fd, 0);
+	if (c->memory == MAP_FAILED) {
+		fprintf(stderr, "failed to map guest memory\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int setup_ring(struct Client *c, unsigned int index, unsigned int num, uint64_t offset) {
+	int rc;
+	struct Ring *ring = &c->rings[index];
+	struct VhostUserVringState state = { .index = index, .num = num };
+	struct VhostUserVringAddr addr;
+	uint64_t file = index;
+
+	ring->num = num;
+	ring->offset = offset;
+	vring_init(&ring->vring, num, c->memory + offset, 4096);
+
+	ring->kick_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	ring->call_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (ring->kick_fd < 0 || ring->call_fd < 0) {
+		return -errno;
+	}
+
+	rc = send_message(c, VHOST_USER_SET_VRING_NUM, &state, sizeof(state), NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	state.num = 0;
+	rc = send_message(c, VHOST_USER_SET_VRING_BASE, &state, sizeof(state), NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	// ring addresses are given in the address space of the frontend
+	memset(&addr, 0, sizeof(addr));
+	addr.index = index;
+	addr.desc_user_addr = (uint64_t) (uintptr_t) ring->vring.desc;
+	addr.avail_user_addr = (uint64_t) (uintptr_t) ring->vring.avail;
+	addr.used_user_addr = (uint64_t) (uintptr_t) ring->vring.used;
+
+	rc = send_message(c, VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr), NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = send_message(c, VHOST_USER_SET_VRING_KICK, &file, sizeof(file), &ring->kick_fd, 1);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = send_message(c, VHOST_USER_SET_VRING_CALL, &file, sizeof(file), &ring->call_fd, 1);
+	if (rc < 0) {
+		return rc;
+	}
+
+	state.num = 1;
+	return send_message(c, VHOST_USER_SET_VRING_ENABLE, &state, sizeof(state), NULL, 0);
+}
+
+/**
+ * Make every buffer of the event queue available, buffers are 8 bytes at
+ * `BUFFERS_OFFSET` in guest memory with guest addresses equal to their offset.
+ */
+void fill_eventq(struct Client *c) {
+	struct Ring *ring = &c->rings[VHOST_INPUT_EVENTQ];
+
+	for (unsigned int i = 0; i < ring->num; i++) {
+		ring->vring.desc[i].addr = htole64(BUFFERS_OFFSET + i * sizeof(struct virtio_input_event));
+		ring->vring.desc[i].len = htole32(sizeof(struct virtio_input_event));
+		ring->vring.desc[i].flags = htole16(VRING_DESC_F_WRITE);
+		ring->vring.avail->ring[i] = htole16(i);
+	}
+
+	ring->avail_idx = ring->num;
+	__atomic_store_n(&ring->vring.avail->idx, htole16(ring->avail_idx), __ATOMIC_RELEASE);
+}
+
+int connect_backend(struct Client *c) {
+	int rc;
+	uint64_t features;
+	struct VhostUserMemory memory;
+	struct sockaddr_un addr;
+
+	if (strlen(c->options->socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path %s is too long\n", c->options->socket_path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, c->options->socket_path);
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (c->fd < 0 || connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "failed to connect to %s\n", c->options->socket_path);
+		return -1;
+	}
+
+	rc = get_u64(c, VHOST_USER_GET_FEATURES, &features);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (!(features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) || !(features & (1ULL << VIRTIO_F_VERSION_1))) {
+		fprintf(stderr, "backend features %#lx are missing protocol features or virtio 1.0\n", (unsigned long) features);
+		return -1;
+	}
+
+	features = (1ULL << VHOST_USER_F_PROTOCOL_FEATURES) | (1ULL << VIRTIO_F_VERSION_1);
+	rc = send_message(c, VHOST_USER_SET_FEATURES, &features, sizeof(features), NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = get_u64(c, VHOST_USER_GET_PROTOCOL_FEATURES, &features);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (!(features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))) {
+		fprintf(stderr, "backend does not support the config space\n");
+		return -1;
+	}
+
+	features &= (1ULL << VHOST_USER_PROTOCOL_F_CONFIG) | (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
+	rc = send_message(c, VHOST_USER_SET_PROTOCOL_FEATURES, &features, sizeof(features), NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+	c->protocol_features = features;
+
+	rc = send_message(c, VHOST_USER_SET_OWNER, NULL, 0, NULL, 0);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = read_capabilities(c);
+	if (rc < 0) {
+		return rc;
+	}
+
+	memset(&memory, 0, sizeof(memory));
+	memory.nregions = 1;
+	memory.regions[0].guest_phys_addr = 0;
+	memory.regions[0].memory_size = MEMORY_SIZE;
+	memory.regions[0].userspace_addr = (uint64_t) (uintptr_t) c->memory;
+	memory.regions[0].mmap_offset = 0;
+
+	rc = send_message(c, VHOST_USER_SET_MEM_TABLE, &memory,
+		offsetof(struct VhostUserMemory, regions) + sizeof(struct VhostUserRegion), &c->memory_fd, 1);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = setup_ring(c, VHOST_INPUT_EVENTQ, c->options->queue_size, EVENTQ_OFFSET);
+	if (rc < 0) {
+		return rc;
+	}
+
+	fill_eventq(c);
+
+	return setup_ring(c, VHOST_INPUT_STATUSQ, STATUSQ_SIZE, STATUSQ_OFFSET);
+}
+
+void invalid(struct Client *c, struct virtio_input_event *ev, const char *reason) {
+	fprintf(stderr, "invalid event %u %u %d: %s\n", le16toh(ev->type), le16toh(ev->code), (int) le32toh(ev->value), reason);
+	c->errors++;
+}
+
+/**
+ * Check an event against the capabilities from the config space and the frame it
+ * is part of.
+ */
+void validate(struct Client *c, struct virtio_input_event *ev) {
+	unsigned int type = le16toh(ev->type), code = le16toh(ev->code);
+	int value = le32toh(ev->value);
+	const char *name;
+
+	c->events++;
+
+	if (type == EV_SYN) {
+		if (code == SYN_DROPPED) {
+			invalid(c, ev, "SYN_DROPPED is never relayed");
+		} else if (code == SYN_REPORT) {
+			if (c->options->verbose) {
+				printf("\n");
+			}
+			c->frames++;
+			c->frame_length = 0;
+		}
+		return;
+	}
+
+	if (c->options->verbose) {
+		name = libevdev_event_code_get_name(type, code);
+		if (name != NULL) {
+			printf("%s %d ", name, value);
+		} else {
+			printf("%u:%u %d ", type, code, value);
+		}
+	}
+
+	c->frame_length++;
+
+	if (type >= EV_CNT || code >= BITMAP_SIZE * 8 || !(c->bits[type][code / 8] & (1 << (code % 8)))) {
+		invalid(c, ev, "not a capability of the device");
+	} else if (type == EV_KEY && (value < 0 || value > 2)) {
+		invalid(c, ev, "not a key state");
+	} else if (type == EV_ABS && code != ABS_MT_TRACKING_ID
+			&& (value < (int) le32toh(c->abs[code].min) || value > (int) le32toh(c->abs[code].max))) {
+		invalid(c, ev, "outside of the axis range");
+	}
+}
+
+/**
+ * Validate the events in the used buffers and make the buffers available again.
+ */
+void consume(struct Client *c) {
+	struct Ring *ring = &c->rings[VHOST_INPUT_EVENTQ];
+	struct vring_used_elem *elem;
+	uint16_t used_idx = le16toh(__atomic_load_n(&ring->vring.used->idx, __ATOMIC_ACQUIRE));
+	uint32_t id;
+	uint64_t one = 1;
+
+	while (ring->last_used != used_idx) {
+		elem = &ring->vring.used->ring[ring->last_used % ring->num];
+		ring->last_used++;
+
+		id = le32toh(elem->id);
+		if (id >= ring->num) {
+			fprintf(stderr, "used buffer %u does not exist\n", id);
+			c->errors++;
+			continue;
+		}
+
+		if (le32toh(elem->len) != sizeof(struct virtio_input_event)) {
+			fprintf(stderr, "used buffer %u has length %u\n", id, le32toh(elem->len));
+			c->errors++;
+		} else {
+			validate(c, (struct virtio_input_event *) (c->memory + BUFFERS_OFFSET) + id);
+		}
+
+		ring->vring.avail->ring[ring->avail_idx % ring->num] = htole16(id);
+		ring->avail_idx++;
+	}
+
+	__atomic_store_n(&ring->vring.avail->idx, htole16(ring->avail_idx), __ATOMIC_RELEASE);
+
+	if (write(ring->kick_fd, &one, sizeof(one)) < 0) {
+		c->errors++;
+	}
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+	struct Options *options = state->input;
+
+	switch (key) {
+		case 'n':
+			options->frames = strtoul(arg, NULL, 10);
+			break;
+		case 't':
+			options->timeout_ms = (int) (strtod(arg, NULL) * 1000);
+			if (options->timeout_ms <= 0) {
+				argp_error(state, "%s is not a valid timeout", arg);
+			}
+			break;
+		case 'q':
+			options->queue_size = strtoul(arg, NULL, 10);
+			if (options->queue_size == 0 || options->queue_size > 4096
+					|| (options->queue_size & (options->queue_size - 1)) != 0) {
+				argp_error(state, "%s is not a power of two up to 4096", arg);
+			}
+			break;
+		case 'v':
+			options->verbose = true;
+			break;
+		case ARGP_KEY_ARG:
+			if (options->socket_path != NULL) {
+				argp_usage(state);
+			}
+			options->socket_path = arg;
+			break;
+		case ARGP_KEY_END:
+			if (options->socket_path == NULL) {
+				argp_usage(state);
+			}
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, args_doc, doc };
+
+int main(int argc, char **argv) {
+	int rc;
+	uint64_t count;
+	struct pollfd pfd;
+	struct Options options = {
+		.socket_path = NULL,
+		.frames = 0,
+		.timeout_ms = -1,
+		.queue_size = 64,
+		.verbose = false,
+	};
+	static struct Client client;
+
+	argp_parse(&argp, argc, argv, 0, 0, &options);
+
+	client.options = &options;
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	if (create_memory(&client) < 0 || connect_backend(&client) < 0) {
+		fprintf(stderr, "failed to set up the vhost-user backend\n");
+		return 1;
+	}
+
+	printf("connected to %s\n", client.name);
+	fflush(stdout);
+
+	pfd.fd = client.rings[VHOST_INPUT_EVENTQ].call_fd;
+	pfd.events = POLLIN;
+
+	while (!stop && (options.frames == 0 || client.frames < options.frames)) {
+		rc = poll(&pfd, 1, options.timeout_ms);
+		if (rc == 0) {
+			fprintf(stderr, "no events for %dms\n", options.timeout_ms);
+			break;
+		} else if (rc < 0) {
+			continue;
+		}
+
+		if (read(pfd.fd, &count, sizeof(count)) < 0) {
+			continue;
+		}
+
+		consume(&client);
+	}
+
+	printf("%lu frames %lu events %lu invalid\n", client.frames, client.events, client.errors);
+
+	if (client.frame_length > 0) {
+		printf("last frame has no SYN_REPORT\n");
+		client.errors++;
+	}
+
+	return client.errors > 0 ? 1 : 0;
+}
@@ -1,23 +1,73 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <endian.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <signal.h>
 #include <argp.h>
 #include <libgen.h>
 #include <signal.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 
+#include "histogram.h"
+#include "tap.h"
+#include "vhost_user.h"
+
 #define KEY_CODE_ARRAY_LENGTH 243
 #define MAX_EVENTS 10
+#define FRAME_LENGTH 64
+#define RAW_READ_LENGTH 256
+#define TRACE_MAGIC "EVKMTRC2"
+#define TRACE_BUFFER_SIZE 65536
+#define INOTIFY_BUFFER_SIZE 4096
+#define MAX_TARGETS 8
+#define MT_CODES (ABS_MT_TOOL_Y - ABS_MT_SLOT + 1)
+#define MAX_HOTKEYS 32
+#define HOTKEY_MAX_MODIFIERS 4
+#define HOTKEY_WINDOW_US 300000L
+#define OUTPUT_QUEUE_LENGTH 1024
+#define MAX_MAPS 32
+#define TAP_CAPACITY 4096
+#define TAP_MAX_CAPACITY (1 << 20)
+#define TRANSFORM_ONE 256
+#define REALTIME_PRIORITY 50
+#define PREFAULT_STACK_SIZE (512 * 1024)
+#define BUSY_POLL_WINDOW 2000
+#define LOG_RING_LENGTH 4096
+#define LOG_FLUSH_INTERVAL_NS 10000000L
+#define URING_BATCH_LENGTH 256
+#define URING_MIN_ENTRIES 64
+#define HANDOFF_MAGIC 0x666f646eU
+#define HANDOFF_VERSION 2
+#define HANDOFF_NAME_LENGTH 64
+#define HANDOFF_PATH_LENGTH 256
+#define HANDOFF_TIMEOUT_MS 1000
+#define HANDOFF_ACK_TIMEOUT_MS 20
+#define DEVICE_ALIGNMENT 64
 
 char *label_host = "host";
 char *label_guest = "guest";
@@ -29,62 +79,179 @@ static char doc[] = "Virtual keyboard and mouse switch.\n\n"
 	"The switch capabilities extend to any device under '/dev/input'"
 	" and the switch key can be specified as an option."
 	" The intended use is with the '-g' option as this will grab original devices"
-	" and then route the input events to either the 'host' virtual devices or the"
-	" 'guest' virtual devices. For each device argument a virtual device for the"
-	" host is created with the name '{device}-host' and a virtual device for the"
-	" guest is created with the name '{device}-guest'.";
+	" and then route the input events to one of the targets, by default the 'host'"
+	" virtual devices and the 'guest' virtual devices. For each device argument and"
+	" target a virtual device is created with the name '{device}-{target}'. The"
+	" switch key cycles through the targets and '-j' binds a key to a target."
+	"\vA hotkey SPEC is '[!][MODIFIER+...]KEY[:tap|:double]', for example"
+	" 'KEY_LEFTCTRL+KEY_LEFTALT+KEY_F1', 'KEY_RIGHTSHIFT:double' or '!KEY_CAPSLOCK:tap'."
+	" It fires on the press of KEY while the modifiers are held, on a tap of KEY or on"
+	" a double tap of KEY within 300ms. With '!' KEY is not relayed when the hotkey"
+	" fires. The switch key is only used when no hotkey has the action 'next'.\n\n"
+	"A map RULE is 'KEY=KEY' to remap a key or button, 'KEY<>KEY' to swap two keys or"
+	" buttons, 'REL_AXIS*FACTOR' to scale or, with a negative factor, invert a relative"
+	" axis or 'scroll*FACTOR' to scale the scroll wheels, for example"
+	" 'guest:BTN_LEFT<>BTN_RIGHT,REL_Y*-1,scroll*3'.";
 
 static char args_doc[] = "[Device...]";
 
+enum LONG_OPTION {
+	option_record = 0x100,
+	option_replay,
+	option_replay_fast,
+	option_realtime,
+	option_cpu,
+	option_io_uring,
+	option_busy_poll,
+	option_coalesce,
+	option_motion_rate,
+	option_queue_policy,
+	option_control,
+	option_tap,
+	option_vhost_user,
+	option_takeover
+};
+
 static struct argp_option options[] = {
 	{ "verbose", 'v', 0, 0, "Verbose output" },
 	{ "print-key-codes", 'p', 0, 0, "Print key codes" },
 	{ "grab", 'g', 0, 0, "Grab device" },
 	{ "no-symlink", 'n', 0, 0, "Create no symlinks" },
-	{ "user", 'u', "UID_OR_USER", 0, "Uid or user name to assign to guest device" },
+	{ "user", 'u', "UID_OR_USER", 0, "Uid or user name to assign to all but the first target" },
 	{ "code", 'c', "KEY_OR_CODE", 0, "Key name or key code to be used as switch" },
+	{ "target", 't', "NAME", 0, "Add a target, may be repeated (default host and guest)" },
+	{ "jump", 'j', "NAME=KEY_OR_CODE", 0, "Key name or key code to switch directly to a target" },
+	{ "map", 'm', "TARGET:RULE[,RULE...]", 0, "Transform the events of a target, see below" },
+	{ "hotkey", 'k', "ACTION=SPEC", 0, "Switch to the target ACTION, or the next target if ACTION is 'next', on SPEC, see below" },
+	{ "latency", 'l', 0, 0, "Measure relay latency per device and target, dumped on SIGUSR1 and exit" },
+	{ "raw-read", 'r', 0, 0, "Read events in bulk from the device and only use libevdev to resync" },
+	{ "record", option_record, "FILE", 0, "Record the input events of all devices to a trace file" },
+	{ "replay", option_replay, "FILE", 0, "Replay a trace file instead of reading devices" },
+	{ "replay-fast", option_replay_fast, 0, 0, "Replay as fast as possible instead of at the original timing" },
+	{ "realtime", option_realtime, "PRIORITY", OPTION_ARG_OPTIONAL, "Lock memory and run with SCHED_FIFO at PRIORITY (default 50)" },
+	{ "cpu", option_cpu, "CPU", 0, "Pin to CPU, or 'usb' for the CPU servicing the USB controller interrupt" },
+	{ "busy-poll", option_busy_poll, "USEC", OPTION_ARG_OPTIONAL, "Poll without blocking for USEC after activity (default 2000)" },
+	{ "coalesce", option_coalesce, 0, 0, "Sum up relative motion while the output queue of a vhost-user target is backed up instead of queueing every frame" },
+	{ "motion-rate", option_motion_rate, "HZ", 0, "Relay summed up relative motion at a fixed rate" },
+	{ "queue-policy", option_queue_policy, "POLICY", 0, "Drop the oldest ('drop-old', default) or the newest ('drop-new') frames when the output queue of a target is full" },
+	{ "control", option_control, "PATH", 0, "Serve switching, stats and metrics on a unix socket at PATH" },
+	{ "tap", option_tap, "FRAMES", OPTION_ARG_OPTIONAL, "Publish the relayed frames to a shared memory ring of FRAMES (default 4096) that is handed out on the control socket" },
+	{ "vhost-user", option_vhost_user, "TARGET:DIR", 0, "Serve the devices of a target as vhost-user-input devices on sockets in DIR instead of uinput" },
+	{ "takeover", option_takeover, 0, 0, "Take over the devices and targets of the instance serving the control socket at the --control PATH" },
+	{ "io-uring", option_io_uring, 0, 0, "Read devices and write targets in batches through io_uring" },
 	{ 0 }
 };
 
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define NLONGS(x) (((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline void set_bit(unsigned long *array, unsigned int bit) {
+	array[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+static inline void clear_bit(unsigned long *array, unsigned int bit) {
+	array[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+static inline int count_bits(const unsigned long *array, unsigned int length) {
+	int n = 0;
+
+	for (unsigned int i = 0; i < length; i++) {
+		n += __builtin_popcountl(array[i]);
+	}
+
+	return n;
+}
+
 struct KeyCode {
 	char *key;
 	unsigned int code;
 };
 
+struct Device;
+struct DeviceTarget;
+struct Options;
+struct Router;
+struct VhostUser;
+
+int uring_queue_frame(struct DeviceTarget *t);
+long elapsed_ns(struct timespec *start);
+int target_index(struct Options *options, char *name);
+void detach(struct Device *device, struct Options *options, int epfd);
+int vhost_open(struct Device *device, struct Options *options, unsigned int target);
+void vhost_close(struct VhostUser *v);
+int vhost_kick_fd(struct VhostUser *v);
+int motion_flush(struct DeviceTarget *t, struct Options *options);
+void takeover_refuse();
+
 void key_code_print_key_codes();
 int key_code_parse(unsigned int *code, char *name_or_code);
 const struct KeyCode* key_code_by_code(unsigned int code);
 const struct KeyCode key_codes[];
 
-enum TARGET {
-	initialized,
-	host,
-	guest
-};
-
-char* target_label(enum TARGET target) {
-	switch (target) {
-		case initialized:
-		case host:
-			return label_host;
-		case guest:
-			return label_guest;
-	}
-}
-
-enum TARGET flip_target(enum TARGET target) {
-	switch (target) {
-		case host:
-			return guest;
-		case guest:
-		case initialized:
-			return host;
-	}
-}
-
 struct DeviceTarget {
 	struct libevdev_uinput *uidev;
 	char *symlink_path;
+
+	// set instead of `uidev` for a vhost-user target, see `vhost_write_frame()`
+	struct VhostUser *vhost;
+
+	// uinput device or vhost-user socket handed over by the previous instance,
+	// -1 once it is adopted by `create_target()`, see `takeover()`
+	int takeover_fd;
+
+	// events are buffered until `SYN_REPORT` and written to `fd` with a single syscall
+	int fd;
+	struct input_event frame[FRAME_LENGTH];
+	size_t frame_length;
+
+	unsigned long frames_written;
+	unsigned long syscalls_saved;
+	unsigned long bytes_written;
+
+	// published with every frame when tapping, see `tap_publish()`
+	unsigned int device_index;
+	unsigned int target;
+
+	// with io_uring frames are collected in one batch while the other is written
+	struct input_event *batches[2];
+	size_t batch_length[2];
+	unsigned int batch;
+	bool inflight;
+	unsigned int uring_index;
+
+	// kernel timestamp of the frame to return of the uinput write, allocated
+	// apart from the targets with `switch_latency` as they are only recorded with -l
+	struct Histogram *latency;
+
+	// monotonic time of the trigger of the switch to this target until the first frame
+	// of the device is written to it, 0 otherwise, see `record_switch_frame()`
+	long switch_ns;
+	struct Histogram *switch_latency;
+	unsigned long switch_latency_ns;
+
+	// frames timestamped after the trigger of a switch away from this target that
+	// were still relayed to it, see `record_misrouted()`
+	unsigned long frames_misrouted;
+
+	// frames that could not be written right away, see `queue_push()`
+	struct input_event *queue;
+	unsigned long queue_head;
+	unsigned long queue_tail;
+	unsigned long queue_high;
+	bool queue_armed;
+	unsigned long frames_dropped;
+	unsigned long write_errors;
+
+	// relative motion summed up while coalescing, see `frame_flush()`
+	int motion[REL_CNT];
+	unsigned int motion_codes;
+	struct input_event motion_time;
+	unsigned long frames_coalesced;
+
+	// NULL if the events are relayed unchanged, see `transform_apply()`
+	struct Transform *transform;
+	int rel_remainder[REL_CNT];
 };
 
 struct Options {
@@ -92,37 +259,200 @@ struct Options {
 	bool grab;
 	bool no_symlink;
 	bool is_uid_set;
+	bool raw_read;
+	bool latency;
+	bool replay_fast;
+	bool io_uring;
+	bool busy_poll;
+	long busy_poll_window;
+	bool coalesce;
+	long motion_rate;
+	bool drop_new;
+	char *control_path;
+	bool takeover;
+	unsigned int tap_capacity;
+	bool realtime;
+	int priority;
+	int cpu;
+	bool cpu_usb;
+	char *record_path;
+	char *replay_path;
 	unsigned int key_code;
+
+	// targets are indexed by their position in `target_names`
+	char *target_names[MAX_TARGETS];
+	unsigned int target_count;
+	char *jump_specs[MAX_TARGETS];
+	unsigned int jump_count;
+	unsigned int jump_key_codes[MAX_TARGETS];
+	char *hotkey_specs[MAX_HOTKEYS];
+	unsigned int hotkey_count;
+	char *map_specs[MAX_MAPS];
+	unsigned int map_count;
+	char *vhost_specs[MAX_TARGETS];
+	unsigned int vhost_count;
+	char *vhost_dirs[MAX_TARGETS];
 	uid_t uid;
 };
 
+/**
+ * Devices are entries of a contiguous table of cache line aligned entries, see
+ * `device_table_build()`. The state touched for every event comes first, what is
+ * only read when a device is opened, plugged in again or reported on comes last.
+ */
 struct Device {
-	char *device_path;
-
 	int device_fd;
+	unsigned int index;
 	struct libevdev *device;
 
-	struct DeviceTarget host;
-	struct DeviceTarget guest;
+	struct DeviceTarget *targets;
+	unsigned int target_count;
+
+	// target to request at the end of the frame, -1 if no switch is pending
+	int switch_to;
+	unsigned int switch_code;
+
+	unsigned long events_read;
+
+	// keys and buttons held on the device
+	unsigned long keys[NLONGS(KEY_CNT)];
+
+	// keys held across a switch that were released on the previous target but not
+	// pressed on the current one, their release is not relayed, see `hand_over()`
+	unsigned long released[NLONGS(KEY_CNT)];
+
+	// state of the hotkey state machines, see `hotkey_step()`
+	unsigned int hotkey_active;
+	int held_hotkey;
+	unsigned long swallowed[NLONGS(KEY_CNT)];
+	unsigned char hotkey_state[MAX_HOTKEYS];
+	long hotkey_us[MAX_HOTKEYS];
+	struct input_event held;
+
+	// absolute axes and multitouch slots as last relayed, see `resync_state()`,
+	// `mt_slots` is -1 until the device is opened the first time
+	int slot;
+	int mt_slots;
+	int (*mt)[MT_CODES];
+	int abs[ABS_CNT];
+
+	// buffer for bulk reads when `options.raw_read` is set or with io_uring,
+	// allocated by `initialize()`
+	struct input_event *raw_events;
 
 	struct Device *next;
 
-	struct Options options;
+	char *device_path;
+
+	// identifies the device when it is plugged in again, see `attach()`
+	int vendor;
+	int product;
+
+	// every `SYN_DROPPED` read, `resyncs` only counts the recoveries that succeeded
+	unsigned long syn_dropped;
+	unsigned long resyncs;
+	unsigned long resync_ns;
+	long resync_ns_max;
+} __attribute__((aligned(DEVICE_ALIGNMENT)));
+
+struct Router {
+	unsigned int target;
+	// false until the first switch, devices are grabbed on the first switch
+	bool switched;
+	struct Device *head;
+
+	// the switch to apply to all devices at once by `switch_apply()`, -1 if none,
+	// the switch requested last in a loop iteration wins
+	int pending;
+	unsigned int pending_code;
+	struct input_event pending_trigger;
+
+	// the target the pending switch leaves, -1 if none or it stays on the target,
+	// and the time of its trigger, see `record_misrouted()`
+	int pending_from;
+	long pending_ns;
+
+	// from the trigger event to the end of `switch_target()`
+	unsigned long switches;
+	unsigned long switch_ns;
+	unsigned long switch_ns_max;
 };
 
 struct arguments {
 	struct Device *head;
+	struct Device *tail;
 	struct Options options;
 };
 
 
-struct DeviceTarget* device_target(struct Device *d, enum TARGET target) {
-	switch (target) {
-		case host:
-			return &d->host;
-		case guest:
-			return &d->guest;
+static inline struct DeviceTarget* device_target(struct Device *d, unsigned int target) {
+	return &d->targets[target];
+}
+
+// epoll data of a device, the index of the device in `device_table`
+#define DEVICE_TAG (1UL << 63)
+
+/**
+ * The devices of the live path, see `device_table_build()`.
+ */
+struct DeviceTable {
+	struct Device *devices;
+	unsigned int count;
+};
+
+static struct DeviceTable device_table = { .devices = NULL, .count = 0 };
+
+static inline bool device_table_owns(struct Device *d) {
+	return d >= device_table.devices && d < device_table.devices + device_table.count;
+}
+
+static inline struct Device *device_table_get(uint64_t data) {
+	return &device_table.devices[data & ~DEVICE_TAG];
+}
+
+void device_table_free() {
+	free(device_table.devices);
+	device_table.devices = NULL;
+	device_table.count = 0;
+}
+
+int device_epoll_add(int epfd, struct Device *d) {
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = DEVICE_TAG | d->index };
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, d->device_fd, &ev);
+}
+
+char* target_label(struct Options *options, unsigned int target) {
+	return options->target_names[target];
+}
+
+int create_targets(struct Device *d, unsigned int count) {
+	d->targets = calloc(count, sizeof(struct DeviceTarget));
+	if (d->targets == NULL) {
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		d->targets[i].fd = -1;
+		d->targets[i].takeover_fd = -1;
+		d->targets[i].device_index = d->index;
+		d->targets[i].target = i;
+
+		d->targets[i].queue = malloc(OUTPUT_QUEUE_LENGTH * sizeof(struct input_event));
+		if (d->targets[i].queue == NULL) {
+			return -1;
+		}
+
+		d->targets[i].latency = calloc(2, sizeof(struct Histogram));
+		if (d->targets[i].latency == NULL) {
+			return -1;
+		}
+		d->targets[i].switch_latency = d->targets[i].latency + 1;
 	}
+
+	d->target_count = count;
+
+	return 0;
 }
 
 int is_valid(struct Device *device) {
@@ -163,16 +493,45 @@ int uid_from_string(uid_t *uid, char *uid_or_user_name) {
 	return 0;
 }
 
+// set once the devices are handed over to a new instance, see `control_handoff_ack()`,
+// or once a takeover fails and they stay with the previous one, see `takeover_refuse()`
+static bool handed_off = false;
+
+// connection to the previous instance until the takeover is acknowledged, see `takeover()`
+static int takeover_fd = -1;
+
 void free_device_target(struct DeviceTarget *t) {
 	if (t->uidev != NULL) {
-		libevdev_uinput_destroy(t->uidev);
+		// a handed over device lives on in the new instance
+		if (!handed_off) {
+			libevdev_uinput_destroy(t->uidev);
+		}
 		t->uidev = NULL;
+	} else if (t->vhost == NULL && t->fd != -1) {
+		// a device taken over from the previous instance is destroyed with its last file descriptor
+		close(t->fd);
+		t->fd = -1;
 	}
 
+	if (t->takeover_fd != -1) {
+		close(t->takeover_fd);
+		t->takeover_fd = -1;
+	}
+
+	vhost_close(t->vhost);
+	t->vhost = NULL;
+
 	if (t->symlink_path) {
 		free(t->symlink_path);
 		t->symlink_path = NULL;
 	}
+
+	free(t->queue);
+	t->queue = NULL;
+
+	free(t->latency);
+	t->latency = NULL;
+	t->switch_latency = NULL;
 }
 
 void free_device(struct Device *device) {
@@ -186,18 +545,40 @@ void free_device(struct Device *device) {
 		device->device_fd = -1;
 	}
 
-	free_device_target(&device->host);
-	free_device_target(&device->guest);
+	for (unsigned int i = 0; i < device->target_count; i++) {
+		free_device_target(&device->targets[i]);
+	}
+	free(device->targets);
+
+	free(device->mt);
+	free(device->raw_events);
+
+	if (!device_table_owns(device)) {
+		free(device);
+	}
+}
+
+void histogram_print(struct Histogram *h, char *device_path, char *label) {
+	if (h->count == 0) {
+		printf("%s %s: no frames\n", device_path, label);
+		return;
+	}
 
-	free(device);
+	printf("%s %s: %lu frames p50 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+		device_path,
+		label,
+		h->count,
+		histogram_percentile(h, 50.0) / 1000.0,
+		histogram_percentile(h, 99.0) / 1000.0,
+		histogram_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0);
 }
 
 int epoll_add(int epfd, int fd, void *ptr) {
-	struct epoll_event ev;
-
-	ev.events = EPOLLIN;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
 
-	// note that data is an union and defaults to fd if ptr == NULL
+	// note that data is an union and defaults to fd if ptr == NULL, the upper half
+	// is left zero as the dispatch tests tags such as `QUEUE_TAG` on all of `u64`
 	if (ptr != NULL) {
 	  ev.data.ptr = ptr;
 	} else {
@@ -207,7 +588,7 @@ int epoll_add(int epfd, int fd, void *ptr) {
 	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-int initialize_symlink_path(struct Device *d, enum TARGET target) {
+int initialize_symlink_path(struct Device *d, struct Options *options, unsigned int target) {
 	int rc = 0;
 	char *path, *name, *label;
 	size_t size;
@@ -218,7 +599,7 @@ int initialize_symlink_path(struct Device *d, enum TARGET target) {
 
 	t = device_target(d, target);
 
-	label = target_label(target);
+	label = target_label(options, target);
 
 	size = strlen(path)+strlen(name)+strlen(label)+4;
 
@@ -241,12 +622,18 @@ int file_exists(char *path) {
 	return stat(path, &st) == 0;
 }
 
-int initialize_symlink(struct Device *d, struct Options *options,  enum TARGET target) {
+int initialize_symlink(struct Device *d, struct Options *options, unsigned int target) {
 	int rc;
 
 	struct DeviceTarget *t = device_target(d, target);
 
-	rc = initialize_symlink_path(d, target);
+	// a vhost-user target has no device node and the symlink of a device taken
+	// over from the previous instance is left in place
+	if (t->vhost != NULL || t->uidev == NULL) {
+		return 0;
+	}
+
+	rc = initialize_symlink_path(d, options, target);
 	if (rc < 0) { 
 		fprintf(stderr, "failed to generate symlink path\n");
 	}
@@ -266,7 +653,7 @@ int initialize_symlink(struct Device *d, struct Options *options,  enum TARGET t
 		return rc;
 	}
 
-	if (options->is_uid_set && target == guest) {
+	if (options->is_uid_set && target != 0) {
 		rc = chown(libevdev_uinput_get_devnode(t->uidev), options->uid, -1);
 		if (rc < 0) {
 			fprintf(stderr, "failed to set uid for %s\n", libevdev_uinput_get_devnode(t->uidev));
@@ -277,303 +664,5966 @@ int initialize_symlink(struct Device *d, struct Options *options,  enum TARGET t
 	return 0;
 }
 
-int initialize_target(struct Device *device, struct Options *options, enum TARGET target) {
-	int rc;
-	char *label;
-	struct DeviceTarget *t = device_target(device, target);
+/**
+ * Transforms.
+ *
+ * The map rules of a target are compiled into dense tables indexed by code: the key
+ * or button to relay for every key and button, and a fixed point factor in
+ * `TRANSFORM_ONE` steps for every relative axis. Targets without rules have no
+ * transform and skip this stage.
+ */
+struct Transform {
+	bool active;
+	unsigned short keys[KEY_CNT];
+	int rel_scale[REL_CNT];
+};
 
-	label = target_label(target);
+static struct Transform transforms[MAX_TARGETS];
 
-	rc = libevdev_uinput_create_from_device(device->device, LIBEVDEV_UINPUT_OPEN_MANAGED, &(t->uidev));
-	if (rc < 0) {
-		fprintf(stderr, "failed to create %s input\n", label);
-		return rc;
-	}
+/**
+ * Transform the event in place, returns false if the event is to be dropped.
+ *
+ * The fraction lost when scaling a relative axis is carried over to the next event
+ * of the axis so slow motion isn't lost.
+ */
+static inline bool transform_apply(struct DeviceTarget *t, struct input_event *ev) {
+	long value;
 
-	if (options->verbose) {
-		fprintf(stderr, "create uinput device: %s\n", libevdev_uinput_get_devnode(t->uidev));
-	}
+	switch (ev->type) {
+		case EV_KEY:
+			if (ev->code < KEY_CNT) {
+				ev->code = t->transform->keys[ev->code];
+			}
+			return true;
+		case EV_REL:
+			if (ev->code >= REL_CNT || t->transform->rel_scale[ev->code] == TRANSFORM_ONE) {
+				return true;
+			}
 
-	if (!options->no_symlink) {
-		rc = initialize_symlink(device, options, target);
-		if (rc < 0) {
-			return 0;
-		}
-	}
+			value = (long) ev->value * t->transform->rel_scale[ev->code] + t->rel_remainder[ev->code];
+			ev->value = value / TRANSFORM_ONE;
+			t->rel_remainder[ev->code] = value - (long) ev->value * TRANSFORM_ONE;
 
-	return 0;
+			return ev->value != 0;
+		default:
+			return true;
+	}
 }
 
-static bool switch_at_next_ev_syn = false;
-static int number_of_keys_pressed = 0;
-
 /**
- * Switch and relay events to the target device.
- *
- * The target device is switched by `options->key_code` after the next `EV_SYN` event
- * when no keys are pressed.
+ * Enable the keys remapped to on `dev` for the creation of a target, the keys the
+ * device lacked are set in `added`. The capabilities of the source device are
+ * shared by all its targets, the trace and vhost-user, so they are restored with
+ * `transform_remove_keys()` once the target is created.
  */
-int switch_and_relay_event(struct Device *device, struct Options *options, enum TARGET *target, struct input_event *ev) {
-	int rc;
-	enum TARGET previous_target;
-	char *from, *to;
+void transform_add_keys(struct Transform *tf, struct libevdev *dev, unsigned long *added) {
+	unsigned int mapped;
 
-	if (ev->type == EV_KEY && ev->value == 1) {
-		number_of_keys_pressed++;
-	} else if (ev->type == EV_KEY && ev->value == 0 && number_of_keys_pressed > 0) {
-		number_of_keys_pressed--;
-	}
+	memset(added, 0, NLONGS(KEY_CNT) * sizeof(unsigned long));
 
-	if (options->verbose) {
-		printf("event: %s %s %d\n",
-			libevdev_event_type_get_name(ev->type),
-			libevdev_event_code_get_name(ev->type, ev->code),
-			ev->value);
+	for (unsigned int code = 0; code < KEY_CNT; code++) {
+		mapped = tf->keys[code];
+		if (mapped != code && libevdev_has_event_code(dev, EV_KEY, code)
+				&& !libevdev_has_event_code(dev, EV_KEY, mapped)) {
+			libevdev_enable_event_code(dev, EV_KEY, mapped, NULL);
+			set_bit(added, mapped);
+		}
+	}
+}
 
-		printf("#keys: %d\n", number_of_keys_pressed);
+void transform_remove_keys(struct libevdev *dev, unsigned long *added) {
+	for (unsigned int code = 0; code < KEY_CNT; code++) {
+		if (added[code / BITS_PER_LONG] & (1UL << (code % BITS_PER_LONG))) {
+			libevdev_disable_event_code(dev, EV_KEY, code);
+		}
 	}
+}
+
+int create_target(struct Device *device, struct Options *options, unsigned int target) {
+	int rc;
+	char *label;
+	unsigned long added[NLONGS(KEY_CNT)];
+	struct DeviceTarget *t = device_target(device, target);
+
+	label = target_label(options, target);
 
-	if (ev->type == EV_KEY && ev->code == options->key_code && ev->value == 1) {
-		switch_at_next_ev_syn = true;
+	if (transforms[target].active) {
+		t->transform = &transforms[target];
 	}
 
-	switch (*target) {
-		case guest:
-			rc = libevdev_uinput_write_event(device->guest.uidev, ev->type, ev->code, ev->value);
-			if (rc < 0) {
-				fprintf(stderr, "failed write event\n");
-				return rc;
-			}
-			break;
-		case host:
-		default:
-			rc = libevdev_uinput_write_event(device->host.uidev, ev->type, ev->code, ev->value);
-			if (rc < 0) {
-				fprintf(stderr, "failed write event\n");
-				return rc;
-			}
-			break;
+	if (options->vhost_dirs[target] != NULL) {
+		return vhost_open(device, options, target);
 	}
 
-	if (ev->type == EV_SYN && switch_at_next_ev_syn && number_of_keys_pressed == 0) {
-		// if initialized then grab device
-		if (*target == initialized && options->grab) {
-			rc = libevdev_grab(device->device, LIBEVDEV_GRAB);
-			if (rc < 0) {
-				fprintf(stderr, "failed to grab device");
-				return rc;
-			} 
+	if (t->takeover_fd != -1) {
+		t->fd = t->takeover_fd;
+		t->takeover_fd = -1;
 
-			if (options->verbose) {
-				printf("grabbed device %s\n", device->device_path);
-			}
+		if (options->verbose) {
+			fprintf(stderr, "take over uinput device: %s %s\n", device->device_path, label);
+		}
+	} else {
+		// the target needs the capabilities of the keys the device is remapped to
+		if (t->transform != NULL) {
+			transform_add_keys(t->transform, device->device, added);
 		}
 
-		previous_target = *target;
-		*target = flip_target(*target);
+		rc = libevdev_uinput_create_from_device(device->device, LIBEVDEV_UINPUT_OPEN_MANAGED, &(t->uidev));
 
-		if (options->verbose) {
-			from = target_label(previous_target);
-			to = target_label(*target);
+		if (t->transform != NULL) {
+			transform_remove_keys(device->device, added);
+		}
+		if (rc < 0) {
+			fprintf(stderr, "failed to create %s input\n", label);
+			return rc;
+		}
+
+		t->fd = libevdev_uinput_get_fd(t->uidev);
 
-			printf("flipped target from %s to %s\n", from, to);
+		if (options->verbose) {
+			fprintf(stderr, "create uinput device: %s\n", libevdev_uinput_get_devnode(t->uidev));
 		}
-		
-		switch_at_next_ev_syn = false;
 	}
 
 	return 0;
 }
 
-int next_events(struct Device *device, struct Options *options, enum TARGET *target, unsigned int flag) {
+int initialize_target(struct Device *device, struct Options *options, unsigned int target) {
 	int rc;
-	struct input_event ev;
-	unsigned int f = flag;
-
-	while (true) {
-		rc = libevdev_next_event(device->device, f, &ev);
-		switch (rc) {
-			case LIBEVDEV_READ_STATUS_SUCCESS:
-				rc = switch_and_relay_event(device, options, target, &ev);
-				if (rc < 0) {
-					return rc;
-				}			
-
-				if (options->verbose) {
-					printf("next event -> status success\n");
-				}
-				break;
-			case LIBEVDEV_READ_STATUS_SYNC:
-				if (f != LIBEVDEV_READ_FLAG_FORCE_SYNC) {
-					rc = switch_and_relay_event(device, options, target, &ev);
-					if (rc < 0) {
-						return rc;
-					}
-				}
 
-				f = LIBEVDEV_READ_FLAG_SYNC;
+	rc = create_target(device, options, target);
+	if (rc < 0) {
+		return rc;
+	}
 
-				if (options->verbose) {
-					printf("next event -> status sync\n");
-				}
-				break;
-			case -EAGAIN:
-				return 0;
-			default: 
-				return rc;
+	if (!options->no_symlink) {
+		rc = initialize_symlink(device, options, target);
+		if (rc < 0) {
+			return 0;
 		}
-
-	
 	}
+
+	return 0;
+}
+
+// the device clock is `CLOCK_MONOTONIC` when this is set, see `open_device()`
+static inline bool monotonic_clock(struct Options *options) {
+	return options->latency || options->busy_poll || options->control_path != NULL;
 }
 
-int initialize(struct Device *device, struct Options *options,  int epfd) {
-	int rc, uifd;
+/**
+ * Record the time from the kernel timestamp of `ev` until now.
+ *
+ * The device clock is switched to `CLOCK_MONOTONIC` in `initialize()` when
+ * latency is measured or metrics are served so the timestamps are comparable.
+ */
+void record_latency(struct DeviceTarget *t, struct input_event *ev) {
+	struct timespec now;
+	long latency;
 
-	device->device_fd = open(device->device_path, O_RDONLY|O_NONBLOCK);
-	if (device->device_fd < 0) {
-		fprintf(stderr, "failed to on %s\n", device->device_path);
-		return -1;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	rc = libevdev_new_from_fd(device->device_fd, &(device->device));
-	if (rc < 0) {
-		fprintf(stderr, "failed to initialize %s (%d)\n", device->device_path, rc);
-		return rc;
-	}
+	latency = (now.tv_sec - ev->input_event_sec) * 1000000000L
+		+ now.tv_nsec - ev->input_event_usec * 1000L;
 
+	histogram_record(t->latency, latency > 0 ? latency : 0);
+}
 
-	rc = initialize_target(device, options, host);
-	if (rc < 0) {
-		return 0;
-	}
+/**
+ * Count a switch and record the time from the kernel timestamp of the event that
+ * triggered it until now, if the timestamps are comparable.
+ */
+void record_switch(struct Router *router, struct Options *options, struct input_event *trigger) {
+	struct timespec now;
+	long latency;
 
-	rc = initialize_target(device, options, guest);
-	if (rc < 0) {
-		return 0;
-	}
+	router->switches++;
 
-	rc = epoll_add(epfd, device->device_fd, device); 
-	if (rc < 0) {
-		fprintf(stderr, "failed to poll %s\n", device->device_path);
-		return rc;
+	if (!monotonic_clock(options)) {
+		return;
 	}
 
-	return 0;
-}
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-int create(struct Device **device, char *device_path) {
-	int rc;
-	struct Device *d;
+	latency = (now.tv_sec - trigger->input_event_sec) * 1000000000L
+		+ now.tv_nsec - trigger->input_event_usec * 1000L;
 
-	d = malloc(sizeof(struct Device));
-	if (d == NULL) {
-		return -1;
+	router->switch_ns += latency > 0 ? latency : 0;
+	if (latency > (long) router->switch_ns_max) {
+		router->switch_ns_max = latency;
 	}
+}
 
-	d->device_path = malloc(strlen(device_path)+1);
-	if (d->device_path == NULL) {
-		return -1;
+/**
+ * Record the time from the trigger of the switch to the target until the first frame
+ * of the device is written to it, see `switch_target()`. A frame of a device that was
+ * idle at the switch is measured from its own timestamp, so the time until the device
+ * is used again is not counted.
+ */
+void record_switch_frame(struct DeviceTarget *t) {
+	struct timespec now;
+	struct input_event *ev = &t->frame[t->frame_length - 1];
+	long latency, start;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	start = ev->input_event_sec * 1000000000L + ev->input_event_usec * 1000L;
+	if (start < t->switch_ns) {
+		start = t->switch_ns;
 	}
 
-	strcpy(d->device_path, device_path);
+	latency = now.tv_sec * 1000000000L + now.tv_nsec - start;
+	latency = latency > 0 ? latency : 0;
 
-	d->device_fd = -1;
-	d->device = NULL;
+	histogram_record(t->switch_latency, latency);
+	t->switch_latency_ns += latency;
+	t->switch_ns = 0;
+}
 
-	d->host.uidev = NULL;
-	d->host.symlink_path = NULL;
+/**
+ * Count a frame that ends with `ev` and goes to the target a pending switch leaves
+ * if it happened after the trigger, it was meant for the next target.
+ */
+void record_misrouted(struct Router *router, struct DeviceTarget *t, struct input_event *ev) {
+	if (router->pending_from == (int) t->target
+			&& ev->input_event_sec * 1000000000L + ev->input_event_usec * 1000L > router->pending_ns) {
+		t->frames_misrouted++;
+	}
+}
 
-	d->guest.uidev = NULL;
-	d->guest.symlink_path = NULL;
+/**
+ * Adaptive busy polling.
+ *
+ * After activity the event loop polls without blocking until the window has passed
+ * and then blocks in `epoll_wait()` again. The wake-up latency is the time from the
+ * kernel timestamp of the first event read after a wake-up until the wake-up, kept
+ * apart for wake-ups while spinning and from blocking.
+ */
+struct BusyPoll {
+	struct timespec last_activity;
+	struct timespec woken;
+	bool spinning;
+	bool measure;
+	unsigned long empty_polls;
+	struct Histogram spinning_latency;
+	struct Histogram blocking_latency;
+};
 
-	d->next = NULL;
+static struct BusyPoll busy_poll;
 
-	(*device) = d;
+/**
+ * Timeout for the next `epoll_wait()`.
+ */
+int busy_poll_timeout(struct Options *options) {
+	struct timespec now;
 
-	return 0;
-}
+	if (!options->busy_poll) {
+		return -1;
+	}
 
-void append(struct Device **head, struct Device *device) {
-	struct Device *d, *p;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	p = NULL;
-	d = *head;
+	busy_poll.spinning = (now.tv_sec - busy_poll.last_activity.tv_sec) * 1000000000L
+		+ now.tv_nsec - busy_poll.last_activity.tv_nsec < options->busy_poll_window * 1000L;
 
-	while (d != NULL) {
-		p = d;
-		d = d->next;
-	}
+	return busy_poll.spinning ? 0 : -1;
+}
 
-	d = device;
+/**
+ * Note a return of `epoll_wait()`, only a wake-up for a device is measured as
+ * signals, hotplug, timers and control traffic carry no event timestamp.
+ */
+void busy_poll_woken(struct epoll_event *events, int nfds) {
+	busy_poll.measure = false;
 
-	if (p != NULL) {
-		p->next = d;
+	if (nfds == 0) {
+		busy_poll.empty_polls++;
+		return;
 	}
 
-	if (*head == NULL) {
-		*head = d;
+	for (int n = 0; n < nfds; n++) {
+		if (events[n].data.u64 & DEVICE_TAG) {
+			clock_gettime(CLOCK_MONOTONIC, &busy_poll.woken);
+			busy_poll.measure = true;
+			return;
+		}
 	}
 }
 
-
+/**
+ * Record the wake-up latency for the first event after a wake-up, called for every
+ * relayed event.
+ */
+void busy_poll_record(struct input_event *ev) {
+	long latency;
+
+	if (!busy_poll.measure) {
+		return;
+	}
+
+	busy_poll.measure = false;
+	busy_poll.last_activity = busy_poll.woken;
+
+	latency = (busy_poll.woken.tv_sec - ev->input_event_sec) * 1000000000L
+		+ busy_poll.woken.tv_nsec - ev->input_event_usec * 1000L;
+
+	histogram_record(busy_poll.spinning ? &busy_poll.spinning_latency : &busy_poll.blocking_latency,
+		latency > 0 ? latency : 0);
+}
+
+void busy_poll_print(struct Options *options) {
+	printf("busy poll: window %ldus, %lu empty polls\n", options->busy_poll_window, busy_poll.empty_polls);
+	histogram_print(&busy_poll.spinning_latency, "busy poll", "wake-up while spinning");
+	histogram_print(&busy_poll.blocking_latency, "busy poll", "wake-up from epoll");
+
+	fflush(stdout);
+}
+
+/**
+ * Tap of the relayed frames, see `tap.h`.
+ *
+ * The ring lives in a sealed memfd so consumers can map it but not resize it, and
+ * can't map it writable where the kernel supports `F_SEAL_FUTURE_WRITE`.
+ */
+struct Tap {
+	int fd;
+	struct TapHeader *header;
+	size_t size;
+
+	// the header is only written, without F_SEAL_FUTURE_WRITE every consumer can write
+	// to it, see `tap_publish()`
+	uint32_t capacity;
+	uint64_t head;
+};
+
+static struct Tap tap = { .fd = -1, .header = NULL, .capacity = 0, .head = 0 };
+
+int tap_open(struct Options *options) {
+	int rc, seals = F_SEAL_SHRINK|F_SEAL_GROW;
+
+	tap.size = tap_size(options->tap_capacity);
+	tap.capacity = options->tap_capacity;
+	tap.head = 0;
+
+	tap.fd = memfd_create("evdevkm-tap", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (tap.fd < 0) {
+		return -errno;
+	}
+
+	if (ftruncate(tap.fd, tap.size) < 0) {
+		rc = -errno;
+		close(tap.fd);
+		tap.fd = -1;
+		return rc;
+	}
+
+	tap.header = mmap(NULL, tap.size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, tap.fd, 0);
+	if (tap.header == MAP_FAILED) {
+		rc = -errno;
+		tap.header = NULL;
+		close(tap.fd);
+		tap.fd = -1;
+		return rc;
+	}
+
+	tap_init(tap.header, options->tap_capacity);
+	tap.header->target_count = options->target_count;
+	for (unsigned int i = 0; i < options->target_count && i < TAP_MAX_TARGETS; i++) {
+		strncpy(tap.header->targets[i], options->target_names[i], TAP_NAME_LENGTH - 1);
+	}
+
+#ifdef F_SEAL_FUTURE_WRITE
+	seals |= F_SEAL_FUTURE_WRITE;
+#endif
+
+	if (fcntl(tap.fd, F_ADD_SEALS, seals|F_SEAL_SEAL) < 0) {
+		fcntl(tap.fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL);
+	}
+
+	return 0;
+}
+
+void tap_close() {
+	if (tap.header != NULL) {
+		munmap(tap.header, tap.size);
+		tap.header = NULL;
+	}
+
+	if (tap.fd != -1) {
+		close(tap.fd);
+		tap.fd = -1;
+	}
+}
+
+/**
+ * Output queues.
+ *
+ * Every target has a preallocated queue for frames that could not be written right
+ * away. A uinput write never has to wait, the kernel takes every event or fails, so
+ * only a vhost-user target whose event queue has no buffers left queues frames. While
+ * frames are queued the kick file descriptor of the event queue is polled, tagged
+ * with `QUEUE_TAG` in the low bits of the target pointer, as the driver kicks it when
+ * it makes buffers available, and new frames are appended so the order is kept.
+ * Plain file descriptors are added with the rest of the data zeroed, see
+ * `epoll_add()`, so they never carry a tag. When the queue is full whole frames are
+ * dropped by `options->drop_new`. A stalled target only fills its own queue.
+ */
+#define QUEUE_TAG 1UL
+
+static int output_epfd = -1;
+
+int queue_arm(struct DeviceTarget *t, bool armed) {
+	struct epoll_event ev;
+	int fd;
+
+	if (t->queue_armed == armed || output_epfd < 0) {
+		return 0;
+	}
+
+	// nothing to poll until the frontend sets a kick file descriptor
+	fd = vhost_kick_fd(t->vhost);
+	if (fd == -1) {
+		t->queue_armed = false;
+		return 0;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = (unsigned long) t | QUEUE_TAG;
+
+	if (epoll_ctl(output_epfd, armed ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev) < 0) {
+		return -errno;
+	}
+
+	t->queue_armed = armed;
+
+	return 0;
+}
+
+/**
+ * Drop the oldest frame in the queue.
+ */
+void queue_drop_oldest(struct DeviceTarget *t) {
+	struct input_event *ev;
+
+	while (t->queue_head != t->queue_tail) {
+		ev = &t->queue[t->queue_head++ % OUTPUT_QUEUE_LENGTH];
+		if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+			break;
+		}
+	}
+
+	t->frames_dropped++;
+}
+
+/**
+ * Drop all frames in the queue, the frontend they were queued for is gone, along
+ * with the motion summed up while they were queued.
+ */
+void queue_discard(struct DeviceTarget *t) {
+	queue_arm(t, false);
+
+	while (t->queue_head != t->queue_tail) {
+		queue_drop_oldest(t);
+	}
+
+	memset(t->motion, 0, sizeof(t->motion));
+	t->motion_codes = 0;
+}
+
+/**
+ * Append `n` events to the queue of the target.
+ */
+int queue_push(struct DeviceTarget *t, struct Options *options, struct input_event *events, size_t n) {
+	unsigned long length = t->queue_tail - t->queue_head;
+
+	if (n > OUTPUT_QUEUE_LENGTH) {
+		t->frames_dropped++;
+		return 0;
+	}
+
+	while (length + n > OUTPUT_QUEUE_LENGTH) {
+		if (options->drop_new) {
+			t->frames_dropped++;
+			return 0;
+		}
+
+		queue_drop_oldest(t);
+		length = t->queue_tail - t->queue_head;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		t->queue[t->queue_tail++ % OUTPUT_QUEUE_LENGTH] = events[i];
+	}
+
+	if (t->queue_tail - t->queue_head > t->queue_high) {
+		t->queue_high = t->queue_tail - t->queue_head;
+	}
+
+	return queue_arm(t, true);
+}
+
+/**
+ * Count a write that failed and drop it.
+ */
+void write_failed(struct DeviceTarget *t, int error) {
+	// reported once per target, the count is part of the statistics
+	if (t->write_errors++ == 0) {
+		fprintf(stderr, "failed write event (%d)\n", error);
+	}
+}
+
+/**
+ * vhost-user-input targets.
+ *
+ * A target given with `--vhost-user` is served as a virtio-input device to a
+ * vhost-user frontend such as QEMU instead of being created through uinput. Frames
+ * are written straight into the event queue in guest memory and the guest is
+ * notified with a single eventfd write per frame, which saves the round trip
+ * through evdev and the reads by the frontend. The capabilities of the device are
+ * taken when the target is created and answered from the config space.
+ *
+ * One frontend is served at a time, the listening socket is taken out of epoll
+ * while a frontend is connected. Both sockets are tagged with `VHOST_TAG` in epoll.
+ * The status queue is drained and its LED events are dropped, like those written
+ * to a uinput target.
+ */
+#define VHOST_TAG 4UL
+
+struct VhostRing {
+	unsigned int num;
+	uint64_t desc_user_addr;
+	uint64_t avail_user_addr;
+	uint64_t used_user_addr;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t last_avail;
+	uint16_t used_idx;
+	int kick_fd;
+	int call_fd;
+	bool started;
+	bool enabled;
+};
+
+struct VhostRegion {
+	uint64_t guest_phys_addr;
+	uint64_t memory_size;
+	uint64_t userspace_addr;
+	char *addr;
+	void *mmap_addr;
+	size_t mmap_size;
+};
+
+struct VhostUser {
+	char *path;
+	int listen_fd;
+	int fd;
+
+	// the target served, its frames are queued while the event queue is full
+	struct DeviceTarget *target;
+	uint64_t features;
+	uint64_t protocol_features;
+
+	struct VhostRegion regions[VHOST_USER_MAX_REGIONS];
+	unsigned int region_count;
+	struct VhostRing rings[VHOST_INPUT_QUEUES];
+
+	struct virtio_input_config config;
+
+	// capabilities of the device as they are presented to the guest
+	char name[sizeof(((struct virtio_input_config *) 0)->u.string)];
+	struct virtio_input_devids ids;
+	uint8_t props[sizeof(((struct virtio_input_config *) 0)->u.bitmap)];
+	uint8_t bits[EV_CNT][sizeof(((struct virtio_input_config *) 0)->u.bitmap)];
+	struct input_absinfo abs[ABS_CNT];
+};
+
+int vhost_epoll(struct VhostUser *v, int op, int fd) {
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = (unsigned long) v | VHOST_TAG;
+
+	if (epoll_ctl(output_epfd, op, fd, op == EPOLL_CTL_DEL ? NULL : &ev) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Whether `length` bytes at `addr` lie within `size` bytes at `base`, the addresses
+ * come from the guest so the bounds are checked without wrapping around.
+ */
+static inline bool vhost_region_contains(uint64_t base, uint64_t size, uint64_t addr, uint64_t length) {
+	return addr >= base && addr - base <= size && length <= size - (addr - base);
+}
+
+void *vhost_translate_guest(struct VhostUser *v, uint64_t addr, uint64_t length) {
+	struct VhostRegion *r;
+
+	for (unsigned int i = 0; i < v->region_count; i++) {
+		r = &v->regions[i];
+		if (vhost_region_contains(r->guest_phys_addr, r->memory_size, addr, length)) {
+			return r->addr + (addr - r->guest_phys_addr);
+		}
+	}
+
+	return NULL;
+}
+
+void *vhost_translate_user(struct VhostUser *v, uint64_t addr, uint64_t length) {
+	struct VhostRegion *r;
+
+	for (unsigned int i = 0; i < v->region_count; i++) {
+		r = &v->regions[i];
+		if (vhost_region_contains(r->userspace_addr, r->memory_size, addr, length)) {
+			return r->addr + (addr - r->userspace_addr);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Map the ring addresses, which are given in the address space of the frontend,
+ * again whenever the memory table changes.
+ */
+void vhost_ring_translate(struct VhostUser *v, struct VhostRing *ring) {
+	if (ring->num == 0) {
+		return;
+	}
+
+	ring->desc = vhost_translate_user(v, ring->desc_user_addr, ring->num * sizeof(struct vring_desc));
+	ring->avail = vhost_translate_user(v, ring->avail_user_addr,
+		sizeof(struct vring_avail) + ring->num * sizeof(uint16_t));
+	ring->used = vhost_translate_user(v, ring->used_user_addr,
+		sizeof(struct vring_used) + ring->num * sizeof(struct vring_used_elem));
+}
+
+static inline bool vhost_ring_ready(struct VhostRing *ring) {
+	return ring->started && ring->enabled && ring->desc != NULL && ring->avail != NULL && ring->used != NULL;
+}
+
+void vhost_unmap(struct VhostUser *v) {
+	for (unsigned int i = 0; i < v->region_count; i++) {
+		munmap(v->regions[i].mmap_addr, v->regions[i].mmap_size);
+	}
+	v->region_count = 0;
+
+	for (unsigned int i = 0; i < VHOST_INPUT_QUEUES; i++) {
+		v->rings[i].desc = NULL;
+		v->rings[i].avail = NULL;
+		v->rings[i].used = NULL;
+	}
+}
+
+void vhost_reset(struct VhostUser *v) {
+	struct VhostRing *ring;
+
+	queue_discard(v->target);
+	vhost_unmap(v);
+
+	for (unsigned int i = 0; i < VHOST_INPUT_QUEUES; i++) {
+		ring = &v->rings[i];
+
+		if (ring->kick_fd != -1) {
+			close(ring->kick_fd);
+		}
+		if (ring->call_fd != -1) {
+			close(ring->call_fd);
+		}
+
+		memset(ring, 0, sizeof(struct VhostRing));
+		ring->kick_fd = -1;
+		ring->call_fd = -1;
+	}
+
+	v->features = 0;
+	v->protocol_features = 0;
+}
+
+static inline void vhost_set_bit(uint8_t *bitmap, unsigned int bit) {
+	bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline bool vhost_test_bit(uint8_t *bitmap, unsigned int bit) {
+	return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+/**
+ * Length of a bitmap up to the last byte with a bit set, which is the size the
+ * config space reports.
+ */
+unsigned int vhost_bitmap_size(uint8_t *bitmap, unsigned int size) {
+	while (size > 0 && bitmap[size - 1] == 0) {
+		size--;
+	}
+
+	return size;
+}
+
+/**
+ * Fill the config space for the `select` and `subsel` written by the driver.
+ */
+void vhost_config_update(struct VhostUser *v) {
+	struct virtio_input_config *c = &v->config;
+	struct input_absinfo *abs;
+
+	memset(&c->u, 0, sizeof(c->u));
+	c->size = 0;
+
+	switch (c->select) {
+		case VIRTIO_INPUT_CFG_ID_NAME:
+			c->size = strlen(v->name);
+			memcpy(c->u.string, v->name, c->size);
+			break;
+		case VIRTIO_INPUT_CFG_ID_DEVIDS:
+			c->u.ids = v->ids;
+			c->size = sizeof(c->u.ids);
+			break;
+		case VIRTIO_INPUT_CFG_PROP_BITS:
+			c->size = vhost_bitmap_size(v->props, sizeof(v->props));
+			memcpy(c->u.bitmap, v->props, c->size);
+			break;
+		case VIRTIO_INPUT_CFG_EV_BITS:
+			if (c->subsel < EV_CNT) {
+				c->size = vhost_bitmap_size(v->bits[c->subsel], sizeof(v->bits[c->subsel]));
+				memcpy(c->u.bitmap, v->bits[c->subsel], c->size);
+			}
+			break;
+		case VIRTIO_INPUT_CFG_ABS_INFO:
+			if (c->subsel < ABS_CNT && vhost_test_bit(v->bits[EV_ABS], c->subsel)) {
+				abs = &v->abs[c->subsel];
+				c->u.abs.min = htole32(abs->minimum);
+				c->u.abs.max = htole32(abs->maximum);
+				c->u.abs.fuzz = htole32(abs->fuzz);
+				c->u.abs.flat = htole32(abs->flat);
+				c->u.abs.res = htole32(abs->resolution);
+				c->size = sizeof(c->u.abs);
+			}
+			break;
+	}
+}
+
+/**
+ * Take the capabilities of the device for the config space.
+ */
+void vhost_capabilities(struct VhostUser *v, struct libevdev *device, struct Transform *transform) {
+	int max;
+	const struct input_absinfo *abs;
+
+	snprintf(v->name, sizeof(v->name), "%s", libevdev_get_name(device));
+
+	v->ids.bustype = htole16(libevdev_get_id_bustype(device));
+	v->ids.vendor = htole16(libevdev_get_id_vendor(device));
+	v->ids.product = htole16(libevdev_get_id_product(device));
+	v->ids.version = htole16(libevdev_get_id_version(device));
+
+	for (unsigned int prop = 0; prop < INPUT_PROP_CNT; prop++) {
+		if (libevdev_has_property(device, prop)) {
+			vhost_set_bit(v->props, prop);
+		}
+	}
+
+	for (unsigned int type = 0; type < EV_CNT; type++) {
+		max = libevdev_event_type_get_max(type);
+		if (max < 0 || !libevdev_has_event_type(device, type)) {
+			continue;
+		}
+
+		for (unsigned int code = 0; code <= (unsigned int) max && code < sizeof(v->bits[type]) * 8; code++) {
+			if (libevdev_has_event_code(device, type, code)) {
+				vhost_set_bit(v->bits[type], code);
+			}
+		}
+	}
+
+	for (unsigned int code = 0; code < ABS_CNT; code++) {
+		abs = libevdev_get_abs_info(device, code);
+		if (abs != NULL && vhost_test_bit(v->bits[EV_ABS], code)) {
+			v->abs[code] = *abs;
+		}
+	}
+
+	// and the keys the device is remapped to, see `transform_add_keys()`
+	if (transform != NULL) {
+		for (unsigned int code = 0; code < KEY_CNT; code++) {
+			if (transform->keys[code] != code && libevdev_has_event_code(device, EV_KEY, code)
+					&& transform->keys[code] < sizeof(v->bits[EV_KEY]) * 8) {
+				vhost_set_bit(v->bits[EV_KEY], transform->keys[code]);
+			}
+		}
+	}
+}
+
+/**
+ * Map the regions of guest memory. The sizes come from the frontend, so a region
+ * must neither wrap around nor reach past the end of its file, otherwise the
+ * mapping would be smaller than the region that addresses are checked against.
+ */
+int vhost_set_mem_table(struct VhostUser *v, struct VhostUserMemory *memory, int *fds, unsigned int fd_count) {
+	struct VhostUserRegion *m;
+	struct VhostRegion *r;
+	struct stat st;
+	void *addr;
+
+	vhost_unmap(v);
+
+	if (memory->nregions > VHOST_USER_MAX_REGIONS || memory->nregions != fd_count) {
+		return -EINVAL;
+	}
+
+	for (unsigned int i = 0; i < memory->nregions; i++) {
+		m = &memory->regions[i];
+
+		if (m->memory_size == 0 || m->mmap_offset > SIZE_MAX - m->memory_size) {
+			return -EINVAL;
+		}
+
+		if (fstat(fds[i], &st) < 0) {
+			return -errno;
+		}
+
+		if (st.st_size < 0 || m->memory_size + m->mmap_offset > (uint64_t) st.st_size) {
+			return -EINVAL;
+		}
+
+		addr = mmap(NULL, m->memory_size + m->mmap_offset, PROT_READ|PROT_WRITE, MAP_SHARED, fds[i], 0);
+		if (addr == MAP_FAILED) {
+			return -errno;
+		}
+
+		r = &v->regions[v->region_count++];
+		r->guest_phys_addr = m->guest_phys_addr;
+		r->memory_size = m->memory_size;
+		r->userspace_addr = m->userspace_addr;
+		r->mmap_addr = addr;
+		r->mmap_size = m->memory_size + m->mmap_offset;
+		r->addr = (char *) addr + m->mmap_offset;
+	}
+
+	for (unsigned int i = 0; i < VHOST_INPUT_QUEUES; i++) {
+		vhost_ring_translate(v, &v->rings[i]);
+	}
+
+	return 0;
+}
+
+int vhost_listen(struct VhostUser *v) {
+	int rc;
+	struct sockaddr_un addr;
+
+	if (strlen(v->path) >= sizeof(addr.sun_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, v->path);
+
+	v->listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (v->listen_fd < 0) {
+		return -errno;
+	}
+
+	// a socket left behind by a previous run
+	unlink(v->path);
+
+	if (bind(v->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(v->listen_fd, 1) < 0) {
+		rc = -errno;
+		close(v->listen_fd);
+		v->listen_fd = -1;
+		return rc;
+	}
+
+	return vhost_epoll(v, EPOLL_CTL_ADD, v->listen_fd);
+}
+
+/**
+ * Create the socket of a vhost-user target at `{dir}/{device}-{target}.sock`.
+ */
+int vhost_open(struct Device *device, struct Options *options, unsigned int target) {
+	int rc;
+	size_t size;
+	char *name, *label;
+	struct VhostUser *v;
+	struct DeviceTarget *t = device_target(device, target);
+
+	v = calloc(1, sizeof(struct VhostUser));
+	if (v == NULL) {
+		return -ENOMEM;
+	}
+
+	v->listen_fd = -1;
+	v->fd = -1;
+	v->target = t;
+	for (unsigned int i = 0; i < VHOST_INPUT_QUEUES; i++) {
+		v->rings[i].kick_fd = -1;
+		v->rings[i].call_fd = -1;
+	}
+
+	name = basename(device->device_path);
+	label = target_label(options, target);
+	size = strlen(options->vhost_dirs[target]) + strlen(name) + strlen(label) + 8;
+
+	v->path = malloc(size);
+	if (v->path == NULL) {
+		free(v);
+		return -ENOMEM;
+	}
+	snprintf(v->path, size, "%s/%s-%s.sock", options->vhost_dirs[target], name, label);
+
+	vhost_capabilities(v, device->device, t->transform);
+
+	// the socket of a target taken over keeps its path and the frontend reconnects
+	if (t->takeover_fd != -1) {
+		v->listen_fd = t->takeover_fd;
+		t->takeover_fd = -1;
+		rc = vhost_epoll(v, EPOLL_CTL_ADD, v->listen_fd);
+	} else {
+		rc = vhost_listen(v);
+	}
+	if (rc < 0) {
+		fprintf(stderr, "failed to listen on %s (%d)\n", v->path, rc);
+		free(v->path);
+		free(v);
+		return rc;
+	}
+
+	t->vhost = v;
+
+	if (options->verbose) {
+		fprintf(stderr, "create vhost-user device: %s\n", v->path);
+	}
+
+	return 0;
+}
+
+void vhost_disconnect(struct VhostUser *v) {
+	if (v->fd == -1) {
+		return;
+	}
+
+	vhost_epoll(v, EPOLL_CTL_DEL, v->fd);
+	close(v->fd);
+	v->fd = -1;
+
+	vhost_reset(v);
+
+	if (v->listen_fd != -1) {
+		vhost_epoll(v, EPOLL_CTL_ADD, v->listen_fd);
+	}
+}
+
+void vhost_close(struct VhostUser *v) {
+	if (v == NULL) {
+		return;
+	}
+
+	if (v->fd != -1) {
+		close(v->fd);
+		v->fd = -1;
+	}
+	vhost_reset(v);
+
+	if (v->listen_fd != -1) {
+		close(v->listen_fd);
+		if (!handed_off) {
+			unlink(v->path);
+		}
+	}
+
+	free(v->path);
+	free(v);
+}
+
+void vhost_accept(struct VhostUser *v) {
+	int fd;
+
+	fd = accept4(v->listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	v->fd = fd;
+
+	if (vhost_epoll(v, EPOLL_CTL_ADD, v->fd) < 0) {
+		close(v->fd);
+		v->fd = -1;
+		return;
+	}
+
+	vhost_epoll(v, EPOLL_CTL_DEL, v->listen_fd);
+}
+
+/**
+ * Receive a message and the file descriptors that come with it.
+ *
+ * A frontend sends each message in one go, a message that is cut short is treated
+ * as a protocol error instead of waiting for the rest.
+ */
+int vhost_receive(struct VhostUser *v, struct VhostUserMessage *msg, int *fds, unsigned int *fd_count) {
+	ssize_t n;
+	struct msghdr hdr;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buffer[CMSG_SPACE(VHOST_USER_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	memset(&hdr, 0, sizeof(hdr));
+	iov.iov_base = msg;
+	iov.iov_len = VHOST_USER_HEADER_SIZE;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = u.buffer;
+	hdr.msg_controllen = sizeof(u.buffer);
+
+	*fd_count = 0;
+
+	do {
+		n = recvmsg(v->fd, &hdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		return -errno;
+	} else if (n == 0) {
+		return -ECONNRESET;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *fd_count * sizeof(int));
+		}
+	}
+
+	if (n != VHOST_USER_HEADER_SIZE || msg->size > sizeof(msg->payload)) {
+		return -EPROTO;
+	}
+
+	if (msg->size > 0 && recv(v->fd, &msg->payload, msg->size, MSG_DONTWAIT) != (ssize_t) msg->size) {
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+int vhost_reply(struct VhostUser *v, struct VhostUserMessage *msg) {
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+
+	if (send(v->fd, msg, VHOST_USER_HEADER_SIZE + msg->size, MSG_NOSIGNAL) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+struct VhostRing *vhost_ring(struct VhostUser *v, unsigned int index) {
+	return index < VHOST_INPUT_QUEUES ? &v->rings[index] : NULL;
+}
+
+/**
+ * Take over the file descriptor of a kick or call message, `fds` is updated so the
+ * caller does not close it.
+ */
+int vhost_ring_fd(struct VhostUser *v, struct VhostUserMessage *msg, int *fds, unsigned int fd_count, bool kick) {
+	struct VhostRing *ring = vhost_ring(v, msg->payload.u64 & VHOST_USER_VRING_INDEX_MASK);
+	int *fd, new_fd = -1;
+
+	if (ring == NULL) {
+		return -EINVAL;
+	}
+
+	if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK)) {
+		if (fd_count != 1) {
+			return -EINVAL;
+		}
+		new_fd = fds[0];
+		fds[0] = -1;
+	}
+
+	// the queue of the target waits on the kick file descriptor of the event queue
+	if (kick && ring == &v->rings[VHOST_INPUT_EVENTQ]) {
+		queue_arm(v->target, false);
+	}
+
+	fd = kick ? &ring->kick_fd : &ring->call_fd;
+	if (*fd != -1) {
+		close(*fd);
+	}
+	*fd = new_fd;
+
+	if (kick && ring == &v->rings[VHOST_INPUT_EVENTQ] && v->target->queue_head != v->target->queue_tail) {
+		queue_arm(v->target, true);
+	}
+
+	if (kick) {
+		// without protocol features a ring is enabled as soon as it is started
+		ring->started = true;
+		if (!(v->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+			ring->enabled = true;
+		}
+	}
+
+	return 0;
+}
+
+int vhost_dispatch(struct VhostUser *v, struct VhostUserMessage *msg, int *fds, unsigned int fd_count) {
+	struct VhostRing *ring;
+	struct VhostUserMemory memory;
+	bool reply = false;
+	int rc = 0;
+
+	switch (msg->request) {
+		case VHOST_USER_GET_FEATURES:
+			msg->payload.u64 = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+			msg->size = sizeof(uint64_t);
+			reply = true;
+			break;
+		case VHOST_USER_SET_FEATURES:
+			v->features = msg->payload.u64;
+			break;
+		case VHOST_USER_GET_PROTOCOL_FEATURES:
+			msg->payload.u64 = (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | (1ULL << VHOST_USER_PROTOCOL_F_CONFIG);
+			msg->size = sizeof(uint64_t);
+			reply = true;
+			break;
+		case VHOST_USER_SET_PROTOCOL_FEATURES:
+			v->protocol_features = msg->payload.u64;
+			break;
+		case VHOST_USER_GET_QUEUE_NUM:
+			msg->payload.u64 = VHOST_INPUT_QUEUES;
+			msg->size = sizeof(uint64_t);
+			reply = true;
+			break;
+		case VHOST_USER_SET_OWNER:
+			break;
+		case VHOST_USER_RESET_OWNER:
+			vhost_reset(v);
+			break;
+		case VHOST_USER_SET_MEM_TABLE:
+			// the payload is not aligned in the message
+			memcpy(&memory, &msg->payload.memory, sizeof(memory));
+			rc = vhost_set_mem_table(v, &memory, fds, fd_count);
+			break;
+		case VHOST_USER_SET_VRING_NUM:
+			ring = vhost_ring(v, msg->payload.state.index);
+			if (ring == NULL || msg->payload.state.num == 0 || msg->payload.state.num > 32768
+					|| (msg->payload.state.num & (msg->payload.state.num - 1)) != 0) {
+				rc = -EINVAL;
+				break;
+			}
+			ring->num = msg->payload.state.num;
+			break;
+		case VHOST_USER_SET_VRING_ADDR:
+			ring = vhost_ring(v, msg->payload.addr.index);
+			if (ring == NULL) {
+				rc = -EINVAL;
+				break;
+			}
+			ring->desc_user_addr = msg->payload.addr.desc_user_addr;
+			ring->avail_user_addr = msg->payload.addr.avail_user_addr;
+			ring->used_user_addr = msg->payload.addr.used_user_addr;
+			vhost_ring_translate(v, ring);
+			if (ring->desc == NULL || ring->avail == NULL || ring->used == NULL) {
+				rc = -EFAULT;
+			}
+			break;
+		case VHOST_USER_SET_VRING_BASE:
+			ring = vhost_ring(v, msg->payload.state.index);
+			if (ring == NULL) {
+				rc = -EINVAL;
+				break;
+			}
+			ring->last_avail = msg->payload.state.num;
+			ring->used_idx = msg->payload.state.num;
+			break;
+		case VHOST_USER_GET_VRING_BASE:
+			ring = vhost_ring(v, msg->payload.state.index);
+			if (ring == NULL) {
+				rc = -EINVAL;
+				break;
+			}
+			ring->started = false;
+			if (ring == &v->rings[VHOST_INPUT_EVENTQ]) {
+				queue_arm(v->target, false);
+			}
+			if (ring->kick_fd != -1) {
+				close(ring->kick_fd);
+				ring->kick_fd = -1;
+			}
+			msg->payload.state.num = ring->last_avail;
+			msg->size = sizeof(msg->payload.state);
+			reply = true;
+			break;
+		case VHOST_USER_SET_VRING_KICK:
+			rc = vhost_ring_fd(v, msg, fds, fd_count, true);
+			break;
+		case VHOST_USER_SET_VRING_CALL:
+			rc = vhost_ring_fd(v, msg, fds, fd_count, false);
+			break;
+		case VHOST_USER_SET_VRING_ERR:
+			break;
+		case VHOST_USER_SET_VRING_ENABLE:
+			ring = vhost_ring(v, msg->payload.state.index);
+			if (ring == NULL) {
+				rc = -EINVAL;
+				break;
+			}
+			ring->enabled = msg->payload.state.num != 0;
+			break;
+		case VHOST_USER_GET_CONFIG:
+		case VHOST_USER_SET_CONFIG:
+			if (msg->payload.config.size > VHOST_USER_MAX_CONFIG_SIZE
+					|| msg->payload.config.offset > sizeof(v->config)
+					|| msg->payload.config.size > sizeof(v->config) - msg->payload.config.offset) {
+				rc = -EINVAL;
+				break;
+			}
+
+			if (msg->request == VHOST_USER_SET_CONFIG) {
+				memcpy((char *) &v->config + msg->payload.config.offset, msg->payload.config.region, msg->payload.config.size);
+				vhost_config_update(v);
+				break;
+			}
+
+			memcpy(msg->payload.config.region, (char *) &v->config + msg->payload.config.offset, msg->payload.config.size);
+			msg->size = offsetof(struct VhostUserConfig, region) + msg->payload.config.size;
+			reply = true;
+			break;
+		default:
+			fprintf(stderr, "unsupported vhost-user request %u on %s\n", msg->request, v->path);
+			rc = -ENOSYS;
+			break;
+	}
+
+	if (reply) {
+		return vhost_reply(v, msg);
+	}
+
+	if ((msg->flags & VHOST_USER_NEED_REPLY_MASK)
+			&& (v->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+		msg->payload.u64 = rc < 0 ? 1 : 0;
+		msg->size = sizeof(uint64_t);
+		return vhost_reply(v, msg);
+	}
+
+	return rc;
+}
+
+/**
+ * Serve the frontend of a vhost-user target, or accept one.
+ */
+void vhost_handle(struct VhostUser *v) {
+	int rc, fds[VHOST_USER_MAX_FDS];
+	unsigned int fd_count;
+	struct VhostUserMessage msg;
+
+	if (v->fd == -1) {
+		vhost_accept(v);
+		return;
+	}
+
+	while (true) {
+		rc = vhost_receive(v, &msg, fds, &fd_count);
+		if (rc == -EAGAIN) {
+			return;
+		}
+
+		if (rc == 0) {
+			rc = vhost_dispatch(v, &msg, fds, fd_count);
+		}
+
+		for (unsigned int i = 0; i < fd_count; i++) {
+			if (fds[i] != -1) {
+				close(fds[i]);
+			}
+		}
+
+		if (rc < 0) {
+			if (rc != -ECONNRESET) {
+				fprintf(stderr, "vhost-user frontend of %s failed (%d)\n", v->path, rc);
+			}
+			vhost_disconnect(v);
+			return;
+		}
+	}
+}
+
+static inline void vhost_used(struct VhostRing *ring, uint16_t head, uint32_t length) {
+	struct vring_used_elem *elem = &ring->used->ring[ring->used_idx & (ring->num - 1)];
+
+	elem->id = htole32(head);
+	elem->len = htole32(length);
+	ring->used_idx++;
+}
+
+/**
+ * Publish the used buffers and notify the driver unless it has asked not to be.
+ */
+int vhost_notify(struct VhostRing *ring) {
+	uint64_t one = 1;
+
+	__atomic_store_n(&ring->used->idx, htole16(ring->used_idx), __ATOMIC_RELEASE);
+
+	// the flags must be read after the index is visible to the driver
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (ring->call_fd == -1 || (le16toh(ring->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT)) {
+		return 0;
+	}
+
+	if (write(ring->call_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Return the buffers of the status queue to the driver, the LED events are dropped.
+ */
+void vhost_drain_status(struct VhostUser *v) {
+	struct VhostRing *ring = &v->rings[VHOST_INPUT_STATUSQ];
+	uint16_t avail_idx;
+
+	if (!vhost_ring_ready(ring)) {
+		return;
+	}
+
+	avail_idx = le16toh(__atomic_load_n(&ring->avail->idx, __ATOMIC_ACQUIRE));
+	if (avail_idx == ring->last_avail) {
+		return;
+	}
+
+	while (ring->last_avail != avail_idx) {
+		vhost_used(ring, le16toh(ring->avail->ring[ring->last_avail & (ring->num - 1)]), 0);
+		ring->last_avail++;
+	}
+
+	vhost_notify(ring);
+}
+
+/**
+ * Write a frame of `n` events to the event queue of the guest.
+ *
+ * The frame is only written if the driver has made a buffer available for each of
+ * its events, as part of a frame would be merged with the next one by the guest.
+ * Returns 1 if the frame was written, 0 if it was dropped because no frontend is
+ * connected, -EAGAIN if the queue is full and -EMSGSIZE if the frame has more events
+ * than the queue has buffers, such a frame is dropped as it would never fit.
+ */
+int vhost_write_frame(struct DeviceTarget *t, struct input_event *events, size_t n) {
+	struct VhostUser *v = t->vhost;
+	struct VhostRing *ring = &v->rings[VHOST_INPUT_EVENTQ];
+	struct virtio_input_event *event;
+	struct vring_desc *desc;
+	uint16_t avail_idx, head;
+	uint32_t length;
+
+	vhost_drain_status(v);
+
+	// a target without a frontend is like a uinput device nobody reads
+	if (!vhost_ring_ready(ring)) {
+		return 0;
+	}
+
+	// the driver sets the size of the queue, which may be below `FRAME_LENGTH`
+	if (n > ring->num) {
+		t->frames_dropped++;
+		return -EMSGSIZE;
+	}
+
+	avail_idx = le16toh(__atomic_load_n(&ring->avail->idx, __ATOMIC_ACQUIRE));
+	if ((uint16_t) (avail_idx - ring->last_avail) < n) {
+		return -EAGAIN;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		head = le16toh(ring->avail->ring[ring->last_avail & (ring->num - 1)]);
+		ring->last_avail++;
+
+		if (head >= ring->num) {
+			fprintf(stderr, "vhost-user driver of %s made an invalid buffer available\n", v->path);
+			ring->started = false;
+			return -EINVAL;
+		}
+
+		desc = &ring->desc[head];
+		event = vhost_translate_guest(v, le64toh(desc->addr), sizeof(struct virtio_input_event));
+		length = 0;
+
+		if (event != NULL && le32toh(desc->len) >= sizeof(struct virtio_input_event)
+				&& (le16toh(desc->flags) & VRING_DESC_F_WRITE)) {
+			event->type = htole16(events[i].type);
+			event->code = htole16(events[i].code);
+			event->value = htole32(events[i].value);
+			length = sizeof(struct virtio_input_event);
+		}
+
+		vhost_used(ring, head, length);
+		t->bytes_written += length;
+	}
+
+	vhost_notify(ring);
+
+	return 1;
+}
+
+int vhost_kick_fd(struct VhostUser *v) {
+	return v != NULL ? v->rings[VHOST_INPUT_EVENTQ].kick_fd : -1;
+}
+
+/**
+ * Write the queued frames in order until the event queue of the guest is full.
+ */
+int queue_drain(struct DeviceTarget *t, struct Options *options) {
+	int rc;
+	size_t n;
+	struct input_event events[FRAME_LENGTH];
+
+	while (t->queue_head != t->queue_tail) {
+		n = 0;
+		do {
+			events[n] = t->queue[(t->queue_head + n) % OUTPUT_QUEUE_LENGTH];
+			n++;
+		} while (t->queue_head + n != t->queue_tail && n < FRAME_LENGTH
+			&& !(events[n - 1].type == EV_SYN && events[n - 1].code == SYN_REPORT));
+
+		rc = vhost_write_frame(t, events, n);
+		if (rc == -EAGAIN) {
+			return queue_arm(t, true);
+		} else if (rc == -EMSGSIZE) {
+			t->queue_head += n;
+			continue;
+		} else if (rc < 0) {
+			return rc;
+		} else if (rc == 0) {
+			// the frontend is gone, the frames are not kept for the next one
+			queue_discard(t);
+			return 0;
+		}
+
+		if (options->latency) {
+			record_latency(t, &events[n - 1]);
+		}
+
+		t->frames_written++;
+		t->queue_head += n;
+	}
+
+	return queue_arm(t, false);
+}
+
+/**
+ * The driver kicked the event queue of a target with queued frames, which it does
+ * when it makes buffers available. Once the queue is drained the motion summed up
+ * meanwhile follows, see `frame_flush()`.
+ */
+int vhost_kicked(struct DeviceTarget *t, struct Options *options) {
+	int rc;
+	uint64_t count;
+
+	if (read(vhost_kick_fd(t->vhost), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		return -errno;
+	}
+
+	rc = queue_drain(t, options);
+	if (rc < 0 || t->queue_head != t->queue_tail || options->motion_rate > 0) {
+		return rc;
+	}
+
+	return motion_flush(t, options);
+}
+
+/**
+ * Write the buffered frame to the uinput device with a single syscall.
+ *
+ * A frame for a vhost-user target that can't be written is queued, see `queue_push()`.
+ */
+int frame_write(struct DeviceTarget *t, struct Options *options) {
+	int rc;
+	ssize_t n;
+	size_t offset = 0, size = t->frame_length * sizeof(struct input_event);
+
+	if (t->frame_length == 0) {
+		return 0;
+	}
+
+	if (t->switch_ns != 0) {
+		record_switch_frame(t);
+	}
+
+	if (tap.header != NULL) {
+		tap_publish(tap.header, tap.head++, tap.capacity, t->device_index, t->target, t->frame, t->frame_length);
+	}
+
+	if (t->vhost != NULL) {
+		// frames queued before go first
+		rc = t->queue_head != t->queue_tail ? queue_drain(t, options) : 0;
+
+		if (rc == 0 && t->queue_head == t->queue_tail) {
+			rc = vhost_write_frame(t, t->frame, t->frame_length);
+		} else if (rc == 0) {
+			rc = -EAGAIN;
+		}
+
+		if (rc == -EAGAIN) {
+			rc = queue_push(t, options, t->frame, t->frame_length);
+		} else if (rc == -EMSGSIZE) {
+			rc = 0;
+		} else if (rc > 0) {
+			if (options->latency) {
+				record_latency(t, &t->frame[t->frame_length - 1]);
+			}
+
+			t->frames_written++;
+			rc = 0;
+		}
+
+		t->frame_length = 0;
+		return rc;
+	}
+
+	if (options->io_uring) {
+		// the latency is recorded when the batch write completes
+		t->frames_written++;
+		t->syscalls_saved += t->frame_length - 1;
+
+		return uring_queue_frame(t);
+	}
+
+	t->syscalls_saved += t->frame_length - 1;
+
+	// uinput takes every event of the write or fails, it never asks to retry
+	while (offset < size) {
+		n = write(t->fd, (char *) t->frame + offset, size - offset);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			write_failed(t, -errno);
+			t->frame_length = 0;
+			return 0;
+		}
+
+		offset += n;
+	}
+
+	t->bytes_written += offset;
+
+	if (options->latency) {
+		record_latency(t, &t->frame[t->frame_length - 1]);
+	}
+
+	t->frames_written++;
+	t->frame_length = 0;
+
+	return 0;
+}
+
+#ifdef REL_WHEEL_HI_RES
+#define MOTION_CODES ((1U << REL_X) | (1U << REL_Y) | (1U << REL_HWHEEL) | (1U << REL_WHEEL) \
+	| (1U << REL_WHEEL_HI_RES) | (1U << REL_HWHEEL_HI_RES))
+#else
+#define MOTION_CODES ((1U << REL_X) | (1U << REL_Y) | (1U << REL_HWHEEL) | (1U << REL_WHEEL))
+#endif
+
+/**
+ * Whether the buffered frame only carries relative motion that can be summed up.
+ */
+static inline bool frame_is_motion(struct DeviceTarget *t) {
+	struct input_event *ev = &t->frame[t->frame_length - 1];
+
+	if (ev->type != EV_SYN || ev->code != SYN_REPORT) {
+		return false;
+	}
+
+	for (size_t i = 0; i < t->frame_length - 1; i++) {
+		ev = &t->frame[i];
+		if (ev->type != EV_REL || ev->code >= 32 || !(MOTION_CODES & (1U << ev->code))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Write the summed up relative motion of the target as one frame.
+ *
+ * The frame carries the timestamp of the oldest frame that was summed up. A frame
+ * that is being buffered is set aside and restored.
+ */
+int motion_flush(struct DeviceTarget *t, struct Options *options) {
+	int rc;
+	size_t partial_length = t->frame_length;
+	struct input_event partial[FRAME_LENGTH];
+	struct input_event *ev;
+	unsigned int code;
+
+	if (t->motion_codes == 0) {
+		return 0;
+	}
+
+	memcpy(partial, t->frame, partial_length * sizeof(struct input_event));
+	t->frame_length = 0;
+
+	for (unsigned int codes = t->motion_codes; codes != 0; codes &= codes - 1) {
+		code = __builtin_ctz(codes);
+
+		if (t->motion[code] != 0) {
+			ev = &t->frame[t->frame_length++];
+			*ev = t->motion_time;
+			ev->type = EV_REL;
+			ev->code = code;
+			ev->value = t->motion[code];
+		}
+
+		t->motion[code] = 0;
+	}
+
+	t->motion_codes = 0;
+
+	if (t->frame_length > 0) {
+		t->frame[t->frame_length++] = t->motion_time;
+		rc = frame_write(t, options);
+	} else {
+		rc = 0;
+	}
+
+	memcpy(t->frame, partial, partial_length * sizeof(struct input_event));
+	t->frame_length = partial_length;
+
+	return rc;
+}
+
+/**
+ * Write the buffered frame, or sum it up if it only carries relative motion and
+ * motion is coalesced.
+ *
+ * With `--coalesce` motion is only summed up while frames are queued for the target,
+ * which is the one sign of a consumer falling behind that evdevkm gets, and written
+ * once the queue is drained, see `vhost_kicked()`. A uinput target is never backed
+ * up as far as evdevkm can tell, frames pile up in the buffers of its readers
+ * instead, so there only `--motion-rate` sums up motion, always, until the next tick.
+ *
+ * Any other frame is written right away after the motion summed up so far, so keys
+ * and buttons are never delayed or reordered with respect to the motion.
+ */
+int frame_flush(struct DeviceTarget *t, struct Options *options) {
+	int rc;
+	struct input_event *ev;
+
+	if (t->frame_length == 0) {
+		return 0;
+	}
+
+	if (!options->coalesce) {
+		return frame_write(t, options);
+	}
+
+	if (frame_is_motion(t) && (options->motion_rate > 0 || t->queue_head != t->queue_tail)) {
+		if (t->motion_codes == 0) {
+			t->motion_time = t->frame[t->frame_length - 1];
+		} else {
+			t->frames_coalesced++;
+		}
+
+		for (size_t i = 0; i < t->frame_length - 1; i++) {
+			ev = &t->frame[i];
+			t->motion[ev->code] += ev->value;
+			t->motion_codes |= 1U << ev->code;
+		}
+
+		t->frame_length = 0;
+
+		return 0;
+	}
+
+	rc = motion_flush(t, options);
+	if (rc < 0) {
+		t->frame_length = 0;
+		return rc;
+	}
+
+	return frame_write(t, options);
+}
+
+/**
+ * Write the motion summed up for the targets of a device on the tick of
+ * `--motion-rate` or before a handoff.
+ */
+int motion_flush_device(struct Device *device, struct Options *options) {
+	int rc;
+
+	for (unsigned int i = 0; i < device->target_count; i++) {
+		rc = motion_flush(device_target(device, i), options);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Buffer an event for the target and flush the frame on `SYN_REPORT` or when the buffer is full.
+ */
+int frame_append(struct DeviceTarget *t, struct Options *options, struct input_event *ev) {
+	t->frame[t->frame_length] = *ev;
+
+	if (t->transform == NULL || transform_apply(t, &t->frame[t->frame_length])) {
+		t->frame_length++;
+	}
+
+	if ((ev->type == EV_SYN && ev->code == SYN_REPORT) || t->frame_length == FRAME_LENGTH) {
+		return frame_flush(t, options);
+	}
+
+	return 0;
+}
+
+/**
+ * Trace recording.
+ *
+ * A trace starts with `TRACE_MAGIC`, the number of devices and for each device its
+ * path, ids, properties and capabilities so that the devices can be recreated
+ * without the original hardware. The header is followed by one record per event:
+ *
+ *   varint  microseconds since the previous record
+ *   varint  device index
+ *   byte    type
+ *   varint  code
+ *   varint  zigzag encoded value
+ *
+ * Events within a frame share a timestamp, so a typical relative motion event is
+ * recorded in five bytes instead of the 24 bytes of `struct input_event`.
+ *
+ * `SYN_DROPPED` is followed by the events of the delta the resync relayed, see
+ * `resync_append()`, and a `SYN_REPORT`, so that a replay recovers in the same way.
+ */
+static FILE *trace_file = NULL;
+static long trace_last_us = 0;
+
+void trace_put_varint(FILE *f, unsigned long value) {
+	while (value >= 0x80) {
+		putc_unlocked((value & 0x7f) | 0x80, f);
+		value >>= 7;
+	}
+	putc_unlocked(value, f);
+}
+
+unsigned long zigzag_encode(long value) {
+	return ((unsigned long) value << 1) ^ (unsigned long) (value >> 63);
+}
+
+long zigzag_decode(unsigned long value) {
+	return (long) (value >> 1) ^ -(long) (value & 1);
+}
+
+void trace_put_string(FILE *f, const char *s) {
+	size_t length = s != NULL ? strlen(s) : 0;
+
+	trace_put_varint(f, length);
+	fwrite(s, 1, length, f);
+}
+
+void trace_record_event(struct Device *device, struct input_event *ev) {
+	long us, delta;
+
+	if (trace_file == NULL) {
+		return;
+	}
+
+	us = ev->input_event_sec * 1000000L + ev->input_event_usec;
+	delta = us - trace_last_us;
+	trace_last_us = us;
+
+	trace_put_varint(trace_file, delta > 0 ? delta : 0);
+	trace_put_varint(trace_file, device->index);
+	putc_unlocked(ev->type, trace_file);
+	trace_put_varint(trace_file, ev->code);
+	trace_put_varint(trace_file, zigzag_encode(ev->value));
+}
+
+/**
+ * Verbose log.
+ *
+ * The relay loop writes fixed size records to a single producer, single consumer
+ * ring and a flush thread formats and prints them, so verbose output neither
+ * allocates nor blocks the relay. Records are dropped and counted when the ring is
+ * full.
+ */
+enum LogKind {
+	log_event,
+	log_next_success,
+	log_next_sync,
+	log_syn_dropped,
+	log_grab,
+	log_switch
+};
+
+struct LogRecord {
+	enum LogKind kind;
+	struct Device *device;
+	unsigned short type;
+	unsigned short code;
+	int value;
+	// keys held for events, the previous and next target for switches
+	unsigned int a;
+	unsigned int b;
+};
+
+struct Log {
+	struct LogRecord records[LOG_RING_LENGTH];
+	unsigned long head;
+	unsigned long tail;
+	unsigned long dropped;
+	unsigned long dropped_reported;
+
+	struct Options *options;
+	pthread_t thread;
+	bool running;
+	bool stop;
+};
+
+static struct Log log_ring;
+
+void log_record(enum LogKind kind, struct Device *device, unsigned int type, unsigned int code, int value,
+		unsigned int a, unsigned int b) {
+	unsigned long tail = log_ring.tail;
+	struct LogRecord *r;
+
+	if (tail - __atomic_load_n(&log_ring.head, __ATOMIC_ACQUIRE) == LOG_RING_LENGTH) {
+		__atomic_store_n(&log_ring.dropped, log_ring.dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	r = &log_ring.records[tail & (LOG_RING_LENGTH - 1)];
+	r->kind = kind;
+	r->device = device;
+	r->type = type;
+	r->code = code;
+	r->value = value;
+	r->a = a;
+	r->b = b;
+
+	__atomic_store_n(&log_ring.tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void log_print(struct LogRecord *r) {
+	switch (r->kind) {
+		case log_event:
+			printf("event: %s %s %d\n",
+				libevdev_event_type_get_name(r->type),
+				libevdev_event_code_get_name(r->type, r->code),
+				r->value);
+			printf("#keys: %u\n", r->a);
+			break;
+		case log_next_success:
+			printf("next event -> status success\n");
+			break;
+		case log_next_sync:
+			printf("next event -> status sync\n");
+			break;
+		case log_syn_dropped:
+			printf("raw read -> syn dropped\n");
+			break;
+		case log_grab:
+			printf("grabbed device %s\n", r->device->device_path);
+			break;
+		case log_switch:
+			printf("switched target from %s to %s\n",
+				target_label(log_ring.options, r->a),
+				target_label(log_ring.options, r->b));
+			break;
+	}
+}
+
+void log_flush() {
+	unsigned long head = log_ring.head;
+	unsigned long tail = __atomic_load_n(&log_ring.tail, __ATOMIC_ACQUIRE);
+	unsigned long dropped = __atomic_load_n(&log_ring.dropped, __ATOMIC_RELAXED);
+
+	if (head == tail && dropped == log_ring.dropped_reported) {
+		return;
+	}
+
+	for (; head != tail; head++) {
+		log_print(&log_ring.records[head & (LOG_RING_LENGTH - 1)]);
+		__atomic_store_n(&log_ring.head, head + 1, __ATOMIC_RELEASE);
+	}
+
+	if (dropped != log_ring.dropped_reported) {
+		printf("log: %lu records dropped\n", dropped - log_ring.dropped_reported);
+		log_ring.dropped_reported = dropped;
+	}
+
+	fflush(stdout);
+}
+
+void *log_run(void *arg) {
+	struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_NS };
+
+	while (!__atomic_load_n(&log_ring.stop, __ATOMIC_ACQUIRE)) {
+		log_flush();
+		nanosleep(&interval, NULL);
+	}
+
+	log_flush();
+
+	return NULL;
+}
+
+/**
+ * Start the flush thread.
+ *
+ * The thread is started before `enter_realtime()` so it keeps the default
+ * scheduling policy and CPU affinity, and with all signals blocked so they are
+ * left to the signal file descriptor of the relay loop.
+ */
+int log_open(struct Options *options) {
+	int rc;
+	sigset_t all, previous;
+
+	log_ring.options = options;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+	rc = pthread_create(&log_ring.thread, NULL, log_run, NULL);
+
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (rc != 0) {
+		fprintf(stderr, "failed to start log thread (%d)\n", rc);
+		return -rc;
+	}
+
+	log_ring.running = true;
+
+	return 0;
+}
+
+void log_close() {
+	if (!log_ring.running) {
+		return;
+	}
+
+	__atomic_store_n(&log_ring.stop, true, __ATOMIC_RELEASE);
+	pthread_join(log_ring.thread, NULL);
+	log_ring.running = false;
+}
+
+/**
+ * Write a synthesized event to the target with the timestamp of `trigger`.
+ */
+int frame_append_event(struct DeviceTarget *t, struct Options *options, struct input_event *trigger,
+		unsigned int type, unsigned int code, int value) {
+	struct input_event ev = *trigger;
+
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+
+	return frame_append(t, options, &ev);
+}
+
+/**
+ * Write a frame with `value` for every key and button held on the device.
+ *
+ * The frame is skipped if no keys are held. `skip_code` is excluded from the frame.
+ */
+int frame_append_keys(struct DeviceTarget *t, struct Options *options, struct input_event *trigger,
+		unsigned long *keys, int value, unsigned int skip_code) {
+	int rc;
+	bool any = false;
+	unsigned int code;
+	unsigned long bits;
+
+	for (unsigned int i = 0; i < NLONGS(KEY_CNT); i++) {
+		for (bits = keys[i]; bits != 0; bits &= bits - 1) {
+			code = i * BITS_PER_LONG + __builtin_ctzl(bits);
+			if (code == skip_code) {
+				continue;
+			}
+
+			rc = frame_append_event(t, options, trigger, EV_KEY, code, value);
+			if (rc < 0) {
+				return rc;
+			}
+			any = true;
+		}
+	}
+
+	if (!any) {
+		return 0;
+	}
+
+	return frame_append_event(t, options, trigger, EV_SYN, SYN_REPORT, 0);
+}
+
+/**
+ * Hand the held keys and buttons of a device over from one target to the next.
+ *
+ * The previous target gets a release for every held key so nothing is stuck and the
+ * next target is primed with the keys that are still held, except for `skip_code`.
+ * Keys that the previous target never saw pressed, as they were swallowed or held
+ * across an earlier switch, are neither released nor pressed. `skip_code` is added
+ * to those so its release is not relayed to the next target either.
+ * A partially buffered frame is moved to the next target so it is not split.
+ */
+int hand_over(struct Device *device, struct Options *options, struct DeviceTarget *from,
+		struct DeviceTarget *to, struct input_event *trigger, unsigned int skip_code) {
+	int rc;
+	size_t partial_length = from->frame_length;
+	struct input_event partial[FRAME_LENGTH];
+	unsigned long held[NLONGS(KEY_CNT)];
+
+	if (from == to) {
+		return 0;
+	}
+
+	memcpy(partial, from->frame, partial_length * sizeof(struct input_event));
+	from->frame_length = 0;
+
+	for (unsigned int i = 0; i < NLONGS(KEY_CNT); i++) {
+		held[i] = device->keys[i] & ~device->released[i] & ~device->swallowed[i];
+	}
+
+	rc = frame_append_keys(from, options, trigger, held, 0, KEY_CNT);
+	if (rc < 0) {
+		return rc;
+	}
+
+	rc = frame_append_keys(to, options, trigger, held, 1, skip_code);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (skip_code < KEY_CNT && (held[skip_code / BITS_PER_LONG] & (1UL << (skip_code % BITS_PER_LONG)))) {
+		set_bit(device->released, skip_code);
+	}
+
+	memcpy(to->frame, partial, partial_length * sizeof(struct input_event));
+	to->frame_length = partial_length;
+
+	return 0;
+}
+
+/**
+ * Switch all devices to `next_target`, only called by `switch_apply()`.
+ *
+ * Devices are grabbed on the first switch when `options->grab` is set. The trigger
+ * key of the hotkey, `skip_code`, is not pressed on the next target.
+ */
+int switch_target(struct Router *router, struct Options *options, unsigned int next_target,
+		struct input_event *trigger, unsigned int skip_code) {
+	int rc;
+	struct Device *d;
+	struct DeviceTarget *to;
+	unsigned int previous_target = router->target;
+	long trigger_ns = trigger->input_event_sec * 1000000000L + trigger->input_event_usec * 1000L;
+
+	for (d = router->head; d != NULL; d = d->next) {
+		if (!router->switched && options->grab && d->device_fd != -1) {
+			rc = libevdev_grab(d->device, LIBEVDEV_GRAB);
+			if (rc < 0) {
+				fprintf(stderr, "failed to grab device %s\n", d->device_path);
+				return rc;
+			}
+
+			if (options->verbose) {
+				log_record(log_grab, d, 0, 0, 0, 0, 0);
+			}
+		}
+
+		to = device_target(d, next_target);
+
+		// every device is measured on its first frame on the new target, the frame
+		// that primes its held keys or else the next frame read from it
+		if (previous_target != next_target && monotonic_clock(options)) {
+			device_target(d, previous_target)->switch_ns = 0;
+			to->switch_ns = trigger_ns;
+		}
+
+		rc = hand_over(d, options, device_target(d, previous_target), to, trigger, skip_code);
+		if (rc < 0) {
+			fprintf(stderr, "failed to hand over %s\n", d->device_path);
+			return rc;
+		}
+	}
+
+	router->target = next_target;
+	router->switched = true;
+
+	record_switch(router, options, trigger);
+
+	if (options->verbose) {
+		log_record(log_switch, NULL, 0, 0, 0, previous_target, next_target);
+	}
+
+	return 0;
+}
+
+/**
+ * The target that `next` switches to, relative to a switch that is pending.
+ */
+unsigned int switch_next(struct Router *router, struct Options *options) {
+	if (router->pending >= 0) {
+		return (router->pending + 1) % options->target_count;
+	}
+
+	return router->switched ? (router->target + 1) % options->target_count : router->target;
+}
+
+/**
+ * Request a switch to `next_target`, it is applied by `switch_apply()`.
+ *
+ * Until then frames are still relayed to the current target, those timestamped
+ * after the trigger are counted as misrouted, see `record_misrouted()`.
+ */
+void switch_request(struct Router *router, unsigned int next_target, struct input_event *trigger, unsigned int skip_code) {
+	router->pending = next_target;
+	router->pending_code = skip_code;
+	router->pending_trigger = *trigger;
+
+	router->pending_from = next_target != router->target ? (int) router->target : -1;
+	router->pending_ns = trigger->input_event_sec * 1000000000L + trigger->input_event_usec * 1000L;
+}
+
+/**
+ * Apply the pending switch to all devices at once.
+ *
+ * Called at one point of each iteration of the event loop, after the events of all
+ * ready devices are relayed, so every frame read in an iteration goes to the same
+ * target, whichever device it came from.
+ */
+int switch_apply(struct Router *router, struct Options *options) {
+	unsigned int next_target;
+
+	if (router->pending < 0) {
+		return 0;
+	}
+
+	next_target = router->pending;
+	router->pending = -1;
+	router->pending_from = -1;
+
+	return switch_target(router, options, next_target, &router->pending_trigger, router->pending_code);
+}
+
+/**
+ * Hotkeys.
+ *
+ * A hotkey fires on its trigger key while its modifiers are held, in one of three
+ * modes: on the press of the trigger, on a tap (press and release without other keys
+ * in between) or on a double tap. The hotkey specifications are compiled once into
+ * `hotkeys` and every device runs one small state machine per hotkey, driven by the
+ * flat table `hotkey_transitions`. Only the hotkeys triggered by a key, looked up in
+ * `hotkeys.triggers`, and the hotkeys in progress are stepped for a key event.
+ */
+enum HotkeyMode {
+	hotkey_mode_press,
+	hotkey_mode_tap,
+	hotkey_mode_double
+};
+
+enum HotkeyInput {
+	hotkey_input_press,
+	hotkey_input_release,
+	hotkey_input_other
+};
+
+#define HOTKEY_IDLE 0
+#define HOTKEY_DOWN 1
+#define HOTKEY_UP 2
+#define HOTKEY_FIRE 3
+
+static const unsigned char hotkey_transitions[3][3][3] = {
+	[hotkey_mode_press] = {
+		[HOTKEY_IDLE] = { HOTKEY_FIRE, HOTKEY_IDLE, HOTKEY_IDLE },
+		[HOTKEY_DOWN] = { HOTKEY_FIRE, HOTKEY_IDLE, HOTKEY_IDLE },
+		[HOTKEY_UP] = { HOTKEY_FIRE, HOTKEY_IDLE, HOTKEY_IDLE },
+	},
+	[hotkey_mode_tap] = {
+		[HOTKEY_IDLE] = { HOTKEY_DOWN, HOTKEY_IDLE, HOTKEY_IDLE },
+		[HOTKEY_DOWN] = { HOTKEY_DOWN, HOTKEY_FIRE, HOTKEY_IDLE },
+		[HOTKEY_UP] = { HOTKEY_DOWN, HOTKEY_IDLE, HOTKEY_IDLE },
+	},
+	[hotkey_mode_double] = {
+		[HOTKEY_IDLE] = { HOTKEY_DOWN, HOTKEY_IDLE, HOTKEY_IDLE },
+		[HOTKEY_DOWN] = { HOTKEY_DOWN, HOTKEY_UP, HOTKEY_IDLE },
+		[HOTKEY_UP] = { HOTKEY_FIRE, HOTKEY_IDLE, HOTKEY_IDLE },
+	},
+};
+
+struct Hotkey {
+	unsigned int code;
+	unsigned int modifiers[HOTKEY_MAX_MODIFIERS];
+	unsigned int modifier_count;
+	enum HotkeyMode mode;
+
+	// target to switch to, -1 for the next target
+	int target;
+
+	// the trigger key is not relayed when the hotkey fires
+	bool swallow;
+};
+
+struct Hotkeys {
+	struct Hotkey hotkeys[MAX_HOTKEYS];
+	unsigned int count;
+
+	// bit mask of the hotkeys triggered by each key
+	unsigned int triggers[KEY_CNT];
+};
+
+static struct Hotkeys hotkeys;
+
+// fires when the held press of a swallowed tap hotkey becomes a hold, see `hotkey_expire()`
+static int hotkey_timer_fd = -1;
+
+void hotkey_reset(struct Device *device) {
+	memset(device->hotkey_state, HOTKEY_IDLE, sizeof(device->hotkey_state));
+	device->hotkey_active = 0;
+	memset(device->swallowed, 0, sizeof(device->swallowed));
+	device->held_hotkey = -1;
+}
+
+static inline bool hotkey_modifiers_held(struct Device *device, struct Hotkey *h) {
+	for (unsigned int i = 0; i < h->modifier_count; i++) {
+		if (!(device->keys[h->modifiers[i] / BITS_PER_LONG] & (1UL << (h->modifiers[i] % BITS_PER_LONG)))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static inline void hotkey_set_state(struct Device *device, unsigned int i, unsigned char state, long us) {
+	device->hotkey_state[i] = state;
+	device->hotkey_us[i] = us;
+
+	if (state == HOTKEY_IDLE) {
+		device->hotkey_active &= ~(1U << i);
+	} else {
+		device->hotkey_active |= 1U << i;
+	}
+}
+
+/**
+ * Arm the hotkey timer to fire in `us` unless it fires before.
+ */
+void hotkey_arm(long us) {
+	struct itimerspec spec;
+
+	if (hotkey_timer_fd < 0) {
+		return;
+	}
+
+	if (timerfd_gettime(hotkey_timer_fd, &spec) == 0 && (spec.it_value.tv_sec != 0 || spec.it_value.tv_nsec != 0)
+			&& spec.it_value.tv_sec * 1000000L + spec.it_value.tv_nsec / 1000 <= us) {
+		return;
+	}
+
+	memset(&spec, 0, sizeof(spec));
+	spec.it_value.tv_sec = us / 1000000L;
+	spec.it_value.tv_nsec = us % 1000000L * 1000L;
+
+	timerfd_settime(hotkey_timer_fd, 0, &spec, NULL);
+}
+
+int hotkey_timer(int epfd) {
+	int fd, rc;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	rc = epoll_add(epfd, fd, NULL);
+	if (rc < 0) {
+		close(fd);
+		return rc;
+	}
+
+	hotkey_timer_fd = fd;
+
+	return fd;
+}
+
+/**
+ * Relay the held presses of swallowed tap hotkeys whose window has passed at `us`,
+ * on the clock of the event timestamps, as a hold with a frame of their own. Without
+ * this a tap key held as a modifier would only be relayed on the next key event of
+ * its device. The timer is armed again for the next press to expire.
+ */
+int hotkey_expire(struct Device *head, struct Options *options, struct Router *router, long us) {
+	int rc, i;
+	long left, next = 0;
+	struct Device *d;
+	struct DeviceTarget *t;
+
+	for (d = head; d != NULL; d = d->next) {
+		i = d->held_hotkey;
+		if (i < 0) {
+			continue;
+		}
+
+		left = d->hotkey_us[i] + HOTKEY_WINDOW_US - us;
+		if (left > 0) {
+			if (next == 0 || left < next) {
+				next = left;
+			}
+			continue;
+		}
+
+		hotkey_set_state(d, i, HOTKEY_IDLE, us);
+		d->held_hotkey = -1;
+
+		t = device_target(d, router->target);
+
+		rc = frame_append(t, options, &d->held);
+		if (rc < 0) {
+			return rc;
+		}
+
+		rc = frame_append_event(t, options, &d->held, EV_SYN, SYN_REPORT, 0);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	if (next > 0) {
+		hotkey_arm(next);
+	}
+
+	return 0;
+}
+
+/**
+ * Step the hotkey state machines of the device with a key event.
+ *
+ * A hotkey that fires sets `device->switch_to` so the target is switched at the end
+ * of the frame. If several hotkeys fire on the same event the one with the most
+ * modifiers wins. The press of the trigger of a swallowed tap hotkey is held back
+ * until it is known not to be a tap and is then relayed to `t` ahead of the event.
+ *
+ * Returns 1 if the event is swallowed, 0 if it is relayed or a negative error.
+ */
+int hotkey_step(struct Device *device, struct Options *options, struct Router *router,
+		struct DeviceTarget *t, struct input_event *ev) {
+	int rc, fired = -1;
+	unsigned int i, active, input, state;
+	long us = ev->input_event_sec * 1000000L + ev->input_event_usec;
+	struct Hotkey *h;
+	bool swallowed, swallow;
+
+	swallowed = (device->swallowed[ev->code / BITS_PER_LONG] & (1UL << (ev->code % BITS_PER_LONG))) != 0;
+	swallow = swallowed || (device->held_hotkey >= 0 && hotkeys.hotkeys[device->held_hotkey].code == ev->code);
+
+	if (ev->value == 0 && swallowed) {
+		clear_bit(device->swallowed, ev->code);
+	}
+
+	for (active = device->hotkey_active; active != 0; active &= active - 1) {
+		i = __builtin_ctz(active);
+
+		if (us - device->hotkey_us[i] > HOTKEY_WINDOW_US
+				|| (ev->value == 1 && !(hotkeys.triggers[ev->code] & (1U << i)))) {
+			hotkey_set_state(device, i, HOTKEY_IDLE, us);
+		}
+	}
+
+	// the held press turned out to be a hold
+	if (device->held_hotkey >= 0 && device->hotkey_state[device->held_hotkey] != HOTKEY_DOWN) {
+		device->held_hotkey = -1;
+
+		rc = frame_append(t, options, &device->held);
+		if (rc < 0) {
+			return rc;
+		}
+
+		swallow = swallowed;
+	}
+
+	// repeats only follow the press
+	if (ev->value == 2) {
+		return swallow;
+	}
+
+	for (active = hotkeys.triggers[ev->code]; active != 0; active &= active - 1) {
+		i = __builtin_ctz(active);
+		h = &hotkeys.hotkeys[i];
+
+		if (ev->value == 0) {
+			input = hotkey_input_release;
+		} else {
+			input = hotkey_modifiers_held(device, h) ? hotkey_input_press : hotkey_input_other;
+		}
+
+		state = hotkey_transitions[h->mode][device->hotkey_state[i]][input];
+
+		if (state == HOTKEY_FIRE) {
+			if (fired < 0 || h->modifier_count > hotkeys.hotkeys[fired].modifier_count) {
+				fired = i;
+			}
+			state = HOTKEY_IDLE;
+		}
+
+		hotkey_set_state(device, i, state, us);
+
+		if (state == HOTKEY_DOWN && h->mode == hotkey_mode_tap && h->swallow && device->held_hotkey < 0) {
+			device->held = *ev;
+			device->held_hotkey = i;
+			swallow = true;
+
+			hotkey_arm(HOTKEY_WINDOW_US);
+		}
+	}
+
+	if (fired < 0) {
+		return swallow;
+	}
+
+	h = &hotkeys.hotkeys[fired];
+
+	if (h->target < 0) {
+		device->switch_to = switch_next(router, options);
+	} else {
+		device->switch_to = h->target;
+	}
+	device->switch_code = h->code;
+
+	if (h->swallow) {
+		if (ev->value == 1) {
+			set_bit(device->swallowed, ev->code);
+		}
+
+		if (device->held_hotkey == fired) {
+			device->held_hotkey = -1;
+		}
+
+		return 1;
+	}
+
+	return swallow;
+}
+
+/**
+ * Switch and relay events to the target device.
+ *
+ * A switch is requested at the `SYN_REPORT` that ends the frame in which a hotkey
+ * fires, regardless of other keys being held, and applied to all devices by
+ * `switch_apply()`, see `hotkey_step()` and `switch_target()`. Cycling to the next
+ * target the first time only grabs the devices.
+ */
+int switch_and_relay_event(struct Device *device, struct Options *options, struct Router *router, struct input_event *ev) {
+	int rc;
+	struct DeviceTarget *t = device_target(device, router->target);
+
+	device->events_read++;
+
+	if (options->busy_poll) {
+		busy_poll_record(ev);
+	}
+
+	if (ev->type == EV_KEY && ev->code <= KEY_MAX) {
+		if (ev->value == 0) {
+			clear_bit(device->keys, ev->code);
+		} else {
+			set_bit(device->keys, ev->code);
+		}
+	} else if (ev->type == EV_ABS && ev->code <= ABS_MAX) {
+		if (ev->code == ABS_MT_SLOT) {
+			device->slot = ev->value;
+		} else if (ev->code > ABS_MT_SLOT && ev->code <= ABS_MT_TOOL_Y) {
+			if (device->slot >= 0 && device->slot < device->mt_slots) {
+				device->mt[device->slot][ev->code - ABS_MT_SLOT] = ev->value;
+			}
+		} else {
+			device->abs[ev->code] = ev->value;
+		}
+	}
+
+	if (options->verbose) {
+		log_record(log_event, device, ev->type, ev->code, ev->value,
+			count_bits(device->keys, NLONGS(KEY_CNT)), 0);
+	}
+
+	if (ev->type == EV_KEY && ev->code <= KEY_MAX) {
+		rc = hotkey_step(device, options, router, t, ev);
+		if (rc < 0) {
+			fprintf(stderr, "failed write event\n");
+			return rc;
+		} else if (rc > 0) {
+			return 0;
+		}
+
+		// the release of a key held across a switch went to the previous target, a
+		// press means the release was lost in a resync
+		if (device->released[ev->code / BITS_PER_LONG] & (1UL << (ev->code % BITS_PER_LONG))) {
+			if (ev->value != 2) {
+				clear_bit(device->released, ev->code);
+			}
+			if (ev->value != 1) {
+				return 0;
+			}
+		}
+	}
+
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT && router->pending >= 0) {
+		record_misrouted(router, t, ev);
+	}
+
+	rc = frame_append(t, options, ev);
+	if (rc < 0) {
+		fprintf(stderr, "failed write event\n");
+		return rc;
+	}
+
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT && device->switch_to >= 0) {
+		switch_request(router, device->switch_to, ev, device->switch_code);
+		device->switch_to = -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Append an event of the delta of a resync, it is recorded as well so that a replay
+ * relays the same delta, see `replay_resync()`.
+ */
+int resync_append(struct Device *device, struct Options *options, struct DeviceTarget *t,
+		struct input_event *trigger, unsigned int type, unsigned int code, int value) {
+	struct input_event ev = *trigger;
+
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	trace_record_event(device, &ev);
+
+	return frame_append_event(t, options, trigger, type, code, value);
+}
+
+/**
+ * Relay the difference between the state last relayed and the state of libevdev to
+ * the active target as one frame.
+ */
+int resync_delta(struct Device *device, struct Options *options, struct DeviceTarget *t, struct input_event *trigger) {
+	int rc, value;
+	bool any = false, held;
+	int slot = device->slot;
+
+	for (unsigned int code = 0; code <= KEY_MAX; code++) {
+		if (!libevdev_has_event_code(device->device, EV_KEY, code)) {
+			continue;
+		}
+
+		value = libevdev_get_event_value(device->device, EV_KEY, code);
+		held = (device->keys[code / BITS_PER_LONG] & (1UL << (code % BITS_PER_LONG))) != 0;
+		if ((value != 0) == held) {
+			continue;
+		}
+
+		if (value != 0) {
+			set_bit(device->keys, code);
+		} else {
+			clear_bit(device->keys, code);
+		}
+
+		rc = resync_append(device, options, t, trigger, EV_KEY, code, value);
+		if (rc < 0) {
+			return rc;
+		}
+		any = true;
+	}
+
+	for (unsigned int code = 0; code <= ABS_MAX; code++) {
+		if (code == ABS_MT_SLOT) {
+			code = ABS_MT_TOOL_Y;
+			continue;
+		}
+
+		if (!libevdev_has_event_code(device->device, EV_ABS, code)) {
+			continue;
+		}
+
+		value = libevdev_get_event_value(device->device, EV_ABS, code);
+		if (value == device->abs[code]) {
+			continue;
+		}
+
+		device->abs[code] = value;
+
+		rc = resync_append(device, options, t, trigger, EV_ABS, code, value);
+		if (rc < 0) {
+			return rc;
+		}
+		any = true;
+	}
+
+	for (int s = 0; s < device->mt_slots; s++) {
+		for (unsigned int code = ABS_MT_SLOT + 1; code <= ABS_MT_TOOL_Y; code++) {
+			if (!libevdev_has_event_code(device->device, EV_ABS, code)) {
+				continue;
+			}
+
+			value = libevdev_get_slot_value(device->device, s, code);
+			if (value == device->mt[s][code - ABS_MT_SLOT]) {
+				continue;
+			}
+
+			device->mt[s][code - ABS_MT_SLOT] = value;
+
+			if (slot != s) {
+				slot = s;
+
+				rc = resync_append(device, options, t, trigger, EV_ABS, ABS_MT_SLOT, s);
+				if (rc < 0) {
+					return rc;
+				}
+			}
+
+			rc = resync_append(device, options, t, trigger, EV_ABS, code, value);
+			if (rc < 0) {
+				return rc;
+			}
+			any = true;
+		}
+	}
+
+	// the following events are relative to the current slot of the device
+	device->slot = device->mt_slots > 0 ? libevdev_get_current_slot(device->device) : 0;
+	if (slot != device->slot) {
+		rc = resync_append(device, options, t, trigger, EV_ABS, ABS_MT_SLOT, device->slot);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	if (!any) {
+		return 0;
+	}
+
+	return frame_append_event(t, options, trigger, EV_SYN, SYN_REPORT, 0);
+}
+
+/**
+ * Recover from `SYN_DROPPED`.
+ *
+ * The events libevdev generates to sync its state with the kernel are read and
+ * discarded, and only the difference to the state last relayed is relayed, see
+ * `resync_delta()`. This keeps a storm of overflows from turning into a storm of
+ * events for the target.
+ */
+int resync_state(struct Device *device, struct Options *options, struct Router *router, struct input_event *trigger) {
+	int rc;
+	struct input_event ev, end;
+	struct timespec start;
+	long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// ends the delta in the trace, see `replay_resync()`
+	end = *trigger;
+	end.type = EV_SYN;
+	end.code = SYN_REPORT;
+	end.value = 0;
+
+	do {
+		rc = libevdev_next_event(device->device, LIBEVDEV_READ_FLAG_SYNC, &ev);
+	} while (rc == LIBEVDEV_READ_STATUS_SYNC);
+
+	if (rc != -EAGAIN) {
+		trace_record_event(device, &end);
+		return rc;
+	}
+
+	rc = resync_delta(device, options, device_target(device, router->target), trigger);
+	trace_record_event(device, &end);
+
+	ns = elapsed_ns(&start);
+	device->resyncs++;
+	device->resync_ns += ns;
+	if (ns > device->resync_ns_max) {
+		device->resync_ns_max = ns;
+	}
+
+	return rc;
+}
+
+int next_events(struct Device *device, struct Options *options, struct Router *router, unsigned int flag) {
+	int rc;
+	struct input_event ev;
+	unsigned int f = flag;
+
+	while (true) {
+		rc = libevdev_next_event(device->device, f, &ev);
+		switch (rc) {
+			case LIBEVDEV_READ_STATUS_SUCCESS:
+				trace_record_event(device, &ev);
+
+				rc = switch_and_relay_event(device, options, router, &ev);
+				if (rc < 0) {
+					return rc;
+				}			
+
+				if (options->verbose) {
+					log_record(log_next_success, device, 0, 0, 0, 0, 0);
+				}
+				break;
+			case LIBEVDEV_READ_STATUS_SYNC:
+				// a forced sync follows `SYN_DROPPED` read on a raw path
+				if (f != LIBEVDEV_READ_FLAG_FORCE_SYNC) {
+					trace_record_event(device, &ev);
+					device->syn_dropped++;
+				}
+
+				if (options->verbose) {
+					log_record(log_next_sync, device, 0, 0, 0, 0, 0);
+				}
+
+				rc = resync_state(device, options, router, &ev);
+				if (rc < 0) {
+					return rc;
+				}
+
+				f = LIBEVDEV_READ_FLAG_NORMAL;
+				break;
+			case -EAGAIN:
+				return 0;
+			default: 
+				return rc;
+		}
+
+	
+	}
+}
+
+/**
+ * Resync the device state through libevdev after `SYN_DROPPED` on the raw read paths.
+ *
+ * The io_uring backend reads with a blocking file descriptor, so it is switched to
+ * non-blocking while libevdev drains the device.
+ */
+int resync(struct Device *device, struct Options *options, struct Router *router) {
+	int rc, flags = fcntl(device->device_fd, F_GETFL);
+
+	if (options->io_uring) {
+		fcntl(device->device_fd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	rc = next_events(device, options, router, LIBEVDEV_READ_FLAG_FORCE_SYNC);
+
+	if (options->io_uring) {
+		fcntl(device->device_fd, F_SETFL, flags);
+	}
+
+	return rc;
+}
+
+/**
+ * Relay `count` events read in bulk into `device->raw_events`.
+ */
+int relay_raw_events(struct Device *device, struct Options *options, struct Router *router, size_t count) {
+	int rc;
+	struct input_event *ev;
+
+	for (size_t i = 0; i < count; i++) {
+		ev = &device->raw_events[i];
+
+		trace_record_event(device, ev);
+
+		if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+			device->syn_dropped++;
+
+			// the remaining events are already reflected in the kernel state
+			if (options->verbose) {
+				log_record(log_syn_dropped, device, 0, 0, 0, 0, 0);
+			}
+
+			return resync(device, options, router);
+		}
+
+		rc = switch_and_relay_event(device, options, router, ev);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Read events in bulk directly from the device file descriptor and relay them.
+ *
+ * libevdev is bypassed on this path and its state goes stale. On `SYN_DROPPED` a
+ * forced sync brings libevdev back in line with the kernel and the difference to
+ * the keys, axes and slots last relayed is relayed, see `resync_state()`, so a
+ * release lost in the overflow does not leave a key stuck on the target.
+ */
+int next_raw_events(struct Device *device, struct Options *options, struct Router *router) {
+	int rc;
+	ssize_t n;
+	size_t count;
+
+	while (true) {
+		n = read(device->device_fd, device->raw_events, RAW_READ_LENGTH * sizeof(struct input_event));
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno == EAGAIN ? 0 : -errno;
+		}
+
+		count = n / sizeof(struct input_event);
+
+		rc = relay_raw_events(device, options, router, count);
+		if (rc < 0) {
+			return rc;
+		}
+
+		if (count < RAW_READ_LENGTH) {
+			return 0;
+		}
+	}
+}
+
+/**
+ * io_uring backend.
+ *
+ * Reads of every device and writes of every target are submitted and completed in
+ * batches on one ring, without liburing. The device and uinput file descriptors
+ * are registered as fixed files and the read buffers and output batches as fixed
+ * buffers when the memlock limit allows. Devices are read with a blocking file
+ * descriptor as evdev doesn't support non-blocking io_uring reads, and the epoll
+ * file descriptor is polled on the ring so signals and hotplug are still handled by
+ * the epoll loop in `main()`.
+ *
+ * The user data of a submission is a pointer to the device for reads, a pointer to
+ * the target tagged with `URING_WRITE` for writes, or `URING_POLL`.
+ */
+#define URING_READ 0UL
+#define URING_WRITE 1UL
+#define URING_POLL 2UL
+#define URING_TAG_MASK 3UL
+
+struct DeferredRead {
+	struct Device *device;
+	int res;
+};
+
+struct Uring {
+	int fd;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	unsigned int to_submit;
+	bool fixed_files;
+	bool fixed_buffers;
+	bool epoll_ready;
+
+	unsigned int device_count;
+	unsigned int target_count;
+
+	// reads completed while waiting for a write, see `uring_wait_write()`
+	struct DeferredRead *deferred;
+	unsigned int deferred_count;
+
+	struct Router *router;
+	struct Options *options;
+	int epfd;
+};
+
+static struct Uring uring = { .fd = -1 };
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Create the ring, sized for a read per device and two writes per target.
+ */
+int uring_create(unsigned int device_count, unsigned int target_count) {
+	struct io_uring_params params;
+	unsigned int entries = URING_MIN_ENTRIES;
+	void *ring;
+
+	while (entries < device_count * (1 + 2 * target_count) + 1) {
+		entries *= 2;
+	}
+
+	memset(&params, 0, sizeof(params));
+
+	uring.fd = sys_io_uring_setup(entries, &params);
+	if (uring.fd < 0) {
+		return -errno;
+	}
+
+	uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_size > uring.sq_ring_size) {
+			uring.sq_ring_size = uring.cq_ring_size;
+		}
+		uring.cq_ring_size = uring.sq_ring_size;
+	}
+
+	ring = mmap(NULL, uring.sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		close(uring.fd);
+		return -errno;
+	}
+	uring.sq_ring = ring;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		uring.cq_ring = ring;
+	} else {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED) {
+			close(uring.fd);
+			return -errno;
+		}
+	}
+
+	uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		close(uring.fd);
+		return -errno;
+	}
+
+	uring.sq_head = (unsigned int *) ((char *) uring.sq_ring + params.sq_off.head);
+	uring.sq_tail = (unsigned int *) ((char *) uring.sq_ring + params.sq_off.tail);
+	uring.sq_mask = (unsigned int *) ((char *) uring.sq_ring + params.sq_off.ring_mask);
+	uring.sq_array = (unsigned int *) ((char *) uring.sq_ring + params.sq_off.array);
+	uring.sq_entries = params.sq_entries;
+
+	uring.cq_head = (unsigned int *) ((char *) uring.cq_ring + params.cq_off.head);
+	uring.cq_tail = (unsigned int *) ((char *) uring.cq_ring + params.cq_off.tail);
+	uring.cq_mask = (unsigned int *) ((char *) uring.cq_ring + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) ((char *) uring.cq_ring + params.cq_off.cqes);
+
+	uring.device_count = device_count;
+	uring.target_count = target_count;
+
+	uring.deferred = calloc(device_count, sizeof(struct DeferredRead));
+	if (uring.deferred == NULL) {
+		close(uring.fd);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Submit the queued entries and wait for at least `min_complete` completions.
+ */
+int uring_submit(unsigned int min_complete) {
+	int rc;
+
+	do {
+		rc = sys_io_uring_enter(uring.fd, uring.to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 0) {
+		return -errno;
+	}
+
+	uring.to_submit -= rc;
+
+	return 0;
+}
+
+/**
+ * Get a zeroed submission queue entry, it is queued by `uring_commit()`.
+ */
+struct io_uring_sqe *uring_get_sqe() {
+	unsigned int tail = *uring.sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries) {
+		if (uring_submit(0) < 0) {
+			return NULL;
+		}
+	}
+
+	sqe = &uring.sqes[tail & *uring.sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	return sqe;
+}
+
+void uring_commit() {
+	unsigned int tail = *uring.sq_tail;
+
+	uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.to_submit++;
+}
+
+int uring_prepare_read(struct Device *device) {
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (sqe == NULL) {
+		return -EBUSY;
+	}
+
+	sqe->opcode = uring.fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = uring.fixed_files ? (int) device->index : device->device_fd;
+	sqe->flags = uring.fixed_files ? IOSQE_FIXED_FILE : 0;
+	sqe->off = -1;
+	sqe->addr = (unsigned long) device->raw_events;
+	sqe->len = RAW_READ_LENGTH * sizeof(struct input_event);
+	sqe->buf_index = device->index;
+	sqe->user_data = (unsigned long) device | URING_READ;
+
+	uring_commit();
+
+	return 0;
+}
+
+/**
+ * Submit the batch being filled for the target and start filling the other one.
+ */
+int uring_prepare_write(struct DeviceTarget *t) {
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (sqe == NULL) {
+		return -EBUSY;
+	}
+
+	sqe->opcode = uring.fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = uring.fixed_files ? (int) (uring.device_count + t->uring_index) : t->fd;
+	sqe->flags = uring.fixed_files ? IOSQE_FIXED_FILE : 0;
+	sqe->off = -1;
+	sqe->addr = (unsigned long) t->batches[t->batch];
+	sqe->len = t->batch_length[t->batch] * sizeof(struct input_event);
+	sqe->buf_index = uring.device_count + t->uring_index * 2 + t->batch;
+	sqe->user_data = (unsigned long) t | URING_WRITE;
+
+	uring_commit();
+
+	t->inflight = true;
+	t->batch ^= 1;
+
+	return 0;
+}
+
+int uring_prepare_poll(int fd) {
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (sqe == NULL) {
+		return -EBUSY;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_POLL;
+
+	uring_commit();
+
+	return 0;
+}
+
+void uring_complete_write(struct DeviceTarget *t, int res) {
+	unsigned int written = t->batch ^ 1;
+	struct input_event *ev;
+
+	if (res >= 0) {
+		t->bytes_written += res;
+	}
+
+	if (res < 0) {
+		write_failed(t, res);
+	} else if (uring.options->latency) {
+		for (size_t i = 0; i < t->batch_length[written]; i++) {
+			ev = &t->batches[written][i];
+			if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+				record_latency(t, ev);
+			}
+		}
+	}
+
+	t->batch_length[written] = 0;
+	t->inflight = false;
+
+	if (t->batch_length[t->batch] > 0) {
+		uring_prepare_write(t);
+	}
+}
+
+void uring_complete_read(struct Device *device, int res) {
+	int rc;
+
+	if (device->device_fd == -1) {
+		return;
+	}
+
+	if (res == -ENODEV) {
+		detach(device, uring.options, uring.epfd);
+		return;
+	}
+
+	if (res < 0 && res != -EINTR && res != -EAGAIN) {
+		fprintf(stderr, "failed next event processing with %d\n", res);
+	} else if (res > 0) {
+		rc = relay_raw_events(device, uring.options, uring.router, res / sizeof(struct input_event));
+		if (rc == -ENODEV) {
+			detach(device, uring.options, uring.epfd);
+			return;
+		} else if (rc < 0) {
+			fprintf(stderr, "failed next event processing with %d\n", rc);
+		}
+	}
+
+	uring_prepare_read(device);
+}
+
+/**
+ * Handle the available completions.
+ *
+ * Read completions are deferred when `defer_reads` is set as relaying them may need
+ * the batch that is being waited for. The completion queue head is advanced before
+ * each completion is handled so a nested call continues where this one stopped.
+ */
+void uring_reap(bool defer_reads) {
+	unsigned int head;
+	struct io_uring_cqe *cqe;
+	unsigned long user_data;
+	int res;
+
+	while ((head = *uring.cq_head) != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &uring.cqes[head & *uring.cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+
+		__atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (user_data == URING_POLL) {
+			uring.epoll_ready = true;
+		} else if ((user_data & URING_TAG_MASK) == URING_WRITE) {
+			uring_complete_write((struct DeviceTarget *) (user_data & ~URING_TAG_MASK), res);
+		} else if (defer_reads) {
+			uring.deferred[uring.deferred_count].device = (struct Device *) user_data;
+			uring.deferred[uring.deferred_count].res = res;
+			uring.deferred_count++;
+		} else {
+			uring_complete_read((struct Device *) user_data, res);
+		}
+	}
+}
+
+/**
+ * Wait until the write of the other batch of the target has completed.
+ */
+int uring_wait_write(struct DeviceTarget *t) {
+	int rc;
+
+	while (t->inflight) {
+		rc = uring_submit(1);
+		if (rc < 0) {
+			return rc;
+		}
+
+		uring_reap(true);
+	}
+
+	return 0;
+}
+
+/**
+ * Append the frame of the target to its batch, called by `frame_flush()`.
+ */
+int uring_queue_frame(struct DeviceTarget *t) {
+	int rc;
+	size_t n = t->frame_length;
+
+	if (t->batch_length[t->batch] + n > URING_BATCH_LENGTH) {
+		rc = uring_wait_write(t);
+		if (rc < 0) {
+			t->frame_length = 0;
+			return rc;
+		}
+
+		rc = uring_prepare_write(t);
+		if (rc < 0) {
+			t->frame_length = 0;
+			return rc;
+		}
+	}
+
+	memcpy(t->batches[t->batch] + t->batch_length[t->batch], t->frame, n * sizeof(struct input_event));
+	t->batch_length[t->batch] += n;
+	t->frame_length = 0;
+
+	return 0;
+}
+
+/**
+ * Register the device and target files and buffers and submit the first reads.
+ *
+ * Failing to register is not fatal, the ring then works with plain file descriptors
+ * and buffers.
+ */
+int uring_register(struct Router *router, struct Options *options, int epfd) {
+	int rc, *fds;
+	unsigned int i, n = uring.device_count * (1 + uring.target_count);
+	struct iovec *iovecs;
+	struct Device *d;
+	struct DeviceTarget *t;
+
+	uring.router = router;
+	uring.options = options;
+	uring.epfd = epfd;
+
+	fds = calloc(n, sizeof(int));
+	iovecs = calloc(uring.device_count * (1 + 2 * uring.target_count), sizeof(struct iovec));
+	if (fds == NULL || iovecs == NULL) {
+		free(fds);
+		free(iovecs);
+		return -ENOMEM;
+	}
+
+	for (d = router->head; d != NULL; d = d->next) {
+		fds[d->index] = d->device_fd;
+		iovecs[d->index].iov_base = d->raw_events;
+		iovecs[d->index].iov_len = RAW_READ_LENGTH * sizeof(struct input_event);
+
+		for (i = 0; i < d->target_count; i++) {
+			t = device_target(d, i);
+			t->uring_index = d->index * uring.target_count + i;
+			fds[uring.device_count + t->uring_index] = t->fd;
+
+			for (unsigned int b = 0; b < 2; b++) {
+				t->batches[b] = malloc(URING_BATCH_LENGTH * sizeof(struct input_event));
+				if (t->batches[b] == NULL) {
+					free(fds);
+					free(iovecs);
+					return -ENOMEM;
+				}
+
+				iovecs[uring.device_count + t->uring_index * 2 + b].iov_base = t->batches[b];
+				iovecs[uring.device_count + t->uring_index * 2 + b].iov_len = URING_BATCH_LENGTH * sizeof(struct input_event);
+			}
+		}
+
+		// evdev has no non-blocking io_uring reads, they are served by io_uring workers
+		if (d->device_fd != -1) {
+			fcntl(d->device_fd, F_SETFL, fcntl(d->device_fd, F_GETFL) & ~O_NONBLOCK);
+		}
+	}
+
+	rc = sys_io_uring_register(uring.fd, IORING_REGISTER_FILES, fds, n);
+	uring.fixed_files = rc == 0;
+
+	rc = sys_io_uring_register(uring.fd, IORING_REGISTER_BUFFERS, iovecs, uring.device_count * (1 + 2 * uring.target_count));
+	uring.fixed_buffers = rc == 0;
+
+	if (options->verbose) {
+		printf("io_uring: %u entries, fixed files %s, fixed buffers %s\n",
+			uring.sq_entries,
+			uring.fixed_files ? "yes" : "no",
+			uring.fixed_buffers ? "yes" : "no");
+	}
+
+	free(fds);
+	free(iovecs);
+
+	for (d = router->head; d != NULL; d = d->next) {
+		if (d->device_fd != -1) {
+			uring_prepare_read(d);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Point the fixed file of a device at its new file descriptor after a hotplug.
+ */
+int uring_update_device(struct Device *device) {
+	int fd = device->device_fd;
+	struct io_uring_files_update update = { .offset = device->index, .fds = (unsigned long) &fd };
+
+	if (fd != -1) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	}
+
+	if (uring.fixed_files && sys_io_uring_register(uring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) {
+		return -errno;
+	}
+
+	if (fd != -1) {
+		return uring_prepare_read(device);
+	}
+
+	return 0;
+}
+
+/**
+ * Relay through the ring until the epoll file descriptor has events.
+ */
+int uring_run() {
+	int rc;
+	struct Device *d;
+	struct DeviceTarget *t;
+
+	rc = uring_prepare_poll(uring.epfd);
+	if (rc < 0) {
+		return rc;
+	}
+
+	while (!uring.epoll_ready) {
+		for (d = uring.router->head; d != NULL; d = d->next) {
+			for (unsigned int i = 0; i < d->target_count; i++) {
+				t = device_target(d, i);
+				if (!t->inflight && t->batch_length[t->batch] > 0) {
+					uring_prepare_write(t);
+				}
+			}
+		}
+
+		rc = uring_submit(1);
+		if (rc < 0) {
+			return rc;
+		}
+
+		uring_reap(false);
+
+		// completing a read may defer another one, so take them off the end
+		while (uring.deferred_count > 0) {
+			uring.deferred_count--;
+			uring_complete_read(uring.deferred[uring.deferred_count].device, uring.deferred[uring.deferred_count].res);
+		}
+
+		rc = switch_apply(uring.router, uring.options);
+		if (rc < 0) {
+			fprintf(stderr, "failed to switch target (%d)\n", rc);
+		}
+	}
+
+	uring.epoll_ready = false;
+
+	return 0;
+}
+
+/**
+ * Take the state of the absolute axes and multitouch slots from the device, which
+ * is what the targets are created with.
+ */
+int shadow_init(struct Device *device) {
+	int slots = libevdev_get_num_slots(device->device);
+
+	device->mt_slots = slots > 0 ? slots : 0;
+
+	if (device->mt_slots > 0) {
+		device->mt = calloc(device->mt_slots, sizeof(*device->mt));
+		if (device->mt == NULL) {
+			return -ENOMEM;
+		}
+
+		device->slot = libevdev_get_current_slot(device->device);
+	}
+
+	for (unsigned int code = 0; code <= ABS_MAX; code++) {
+		if (!libevdev_has_event_code(device->device, EV_ABS, code)) {
+			continue;
+		}
+
+		if (code > ABS_MT_SLOT && code <= ABS_MT_TOOL_Y) {
+			for (int s = 0; s < device->mt_slots; s++) {
+				device->mt[s][code - ABS_MT_SLOT] = libevdev_get_slot_value(device->device, s, code);
+			}
+		} else {
+			device->abs[code] = libevdev_get_event_value(device->device, EV_ABS, code);
+		}
+	}
+
+	return 0;
+}
+
+int open_device(struct Device *device, struct Options *options) {
+	int rc;
+
+	// a device taken over from the previous instance is open and grabbed already
+	if (device->device_fd == -1) {
+		device->device_fd = open(device->device_path, O_RDONLY|O_NONBLOCK);
+		if (device->device_fd < 0) {
+			fprintf(stderr, "failed to on %s\n", device->device_path);
+			return -1;
+		}
+	}
+
+	rc = libevdev_new_from_fd(device->device_fd, &(device->device));
+	if (rc < 0) {
+		fprintf(stderr, "failed to initialize %s (%d)\n", device->device_path, rc);
+		close(device->device_fd);
+		device->device_fd = -1;
+		return rc;
+	}
+
+	if (device->mt_slots < 0) {
+		rc = shadow_init(device);
+		if (rc < 0) {
+			fprintf(stderr, "failed to initialize %s (%d)\n", device->device_path, rc);
+			return rc;
+		}
+	}
+
+	if (monotonic_clock(options)) {
+		rc = libevdev_set_clock_id(device->device, CLOCK_MONOTONIC);
+		if (rc < 0) {
+			fprintf(stderr, "failed to set monotonic clock for %s\n", device->device_path);
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+long elapsed_ns(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000000L + now.tv_nsec - start->tv_nsec;
+}
+
+struct Initialization {
+	pthread_t thread;
+	struct Device *device;
+	struct Options *options;
+	int rc;
+
+	long open_ns;
+	long uinput_ns;
+	long symlink_ns;
+};
+
+/**
+ * Open a device and create its targets, run on a thread per device.
+ *
+ * Creating a uinput device waits on the kernel and udev so the devices are
+ * initialized concurrently. Each phase is timed for the startup report.
+ */
+void *initialize(void *arg) {
+	struct Initialization *init = arg;
+	struct Device *device = init->device;
+	struct Options *options = init->options;
+	struct timespec start;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	rc = open_device(device, options);
+	if (rc < 0) {
+		init->rc = rc;
+		return NULL;
+	}
+
+	device->vendor = libevdev_get_id_vendor(device->device);
+	device->product = libevdev_get_id_product(device->device);
+
+	if ((options->raw_read || options->io_uring) && device->raw_events == NULL) {
+		device->raw_events = malloc(RAW_READ_LENGTH * sizeof(struct input_event));
+		if (device->raw_events == NULL) {
+			init->rc = -ENOMEM;
+			return NULL;
+		}
+	}
+
+	init->open_ns = elapsed_ns(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// the targets of a device taken over are created by `takeover()`
+	if (device->targets == NULL) {
+		rc = create_targets(device, options->target_count);
+		if (rc < 0) {
+			init->rc = rc;
+			return NULL;
+		}
+	}
+
+	for (unsigned int i = 0; i < options->target_count; i++) {
+		rc = create_target(device, options, i);
+		if (rc < 0) {
+			init->rc = rc;
+			return NULL;
+		}
+	}
+
+	init->uinput_ns = elapsed_ns(&start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (!options->no_symlink) {
+		// a failing symlink is reported but does not fail the device
+		for (unsigned int i = 0; i < options->target_count; i++) {
+			initialize_symlink(device, options, i);
+		}
+	}
+
+	init->symlink_ns = elapsed_ns(&start);
+	init->rc = 0;
+
+	return NULL;
+}
+
+/**
+ * Initialize all devices concurrently and add them to epoll once they are ready.
+ */
+int initialize_all(struct Device *head, struct Options *options, int epfd) {
+	int rc = 0;
+	unsigned int count = 0, i;
+	struct Device *d;
+	struct Initialization *inits;
+	struct timespec start;
+	long total_ns;
+
+	for (d = head; d != NULL; d = d->next) {
+		count++;
+	}
+
+	inits = calloc(count, sizeof(struct Initialization));
+	if (inits == NULL) {
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (d = head, i = 0; d != NULL; d = d->next, i++) {
+		inits[i].device = d;
+		inits[i].options = options;
+		inits[i].rc = -1;
+
+		if (pthread_create(&inits[i].thread, NULL, initialize, &inits[i]) != 0) {
+			fprintf(stderr, "failed to start initialization of %s\n", d->device_path);
+			count = i;
+			rc = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		pthread_join(inits[i].thread, NULL);
+	}
+
+	total_ns = elapsed_ns(&start);
+
+	for (i = 0; i < count && rc == 0; i++) {
+		d = inits[i].device;
+
+		if (inits[i].rc < 0) {
+			fprintf(stderr, "device %s failed to initialize\n", d->device_path);
+			rc = inits[i].rc;
+			break;
+		}
+
+		// with io_uring the devices are read on the ring, see `uring_register()`
+		if (!options->io_uring) {
+			rc = device_epoll_add(epfd, d);
+			if (rc < 0) {
+				fprintf(stderr, "failed to poll %s\n", d->device_path);
+				break;
+			}
+		}
+
+		if (options->verbose) {
+			printf("initialized %s: open %.1fms uinput %.1fms symlink %.1fms\n",
+				d->device_path,
+				inits[i].open_ns / 1e6,
+				inits[i].uinput_ns / 1e6,
+				inits[i].symlink_ns / 1e6);
+		}
+	}
+
+	if (options->verbose && rc == 0) {
+		printf("initialized %u devices in %.1fms\n", count, total_ns / 1e6);
+	}
+
+	free(inits);
+
+	return rc;
+}
+
+/**
+ * Close an unplugged device while keeping its targets alive.
+ *
+ * The uinput devices are not touched so the targets never see the device disappear.
+ * A partially buffered frame is dropped as it can't be completed and keys held on
+ * the device are released on all targets.
+ */
+void detach(struct Device *device, struct Options *options, int epfd) {
+	struct input_event trigger;
+	struct timespec now;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, device->device_fd, NULL);
+
+	close(device->device_fd);
+	device->device_fd = -1;
+
+	if (options->io_uring) {
+		uring_update_device(device);
+	}
+
+	libevdev_free(device->device);
+	device->device = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memset(&trigger, 0, sizeof(trigger));
+	trigger.input_event_sec = now.tv_sec;
+	trigger.input_event_usec = now.tv_nsec / 1000;
+
+	for (unsigned int i = 0; i < NLONGS(KEY_CNT); i++) {
+		device->keys[i] &= ~device->released[i];
+	}
+
+	for (unsigned int i = 0; i < device->target_count; i++) {
+		device->targets[i].frame_length = 0;
+		frame_append_keys(&device->targets[i], options, &trigger, device->keys, 0, KEY_CNT);
+	}
+
+	memset(device->keys, 0, sizeof(device->keys));
+	memset(device->released, 0, sizeof(device->released));
+	device->switch_to = -1;
+	hotkey_reset(device);
+
+	if (options->verbose) {
+		printf("detached device %s\n", device->device_path);
+	}
+}
+
+/**
+ * Reopen a device that was plugged in again and relay it to the existing targets.
+ *
+ * The device must have the vendor and product of the device the targets were
+ * created from, and it is grabbed again if the original device was grabbed.
+ */
+int attach(struct Device *device, struct Options *options, struct Router *router, int epfd) {
+	int rc;
+
+	rc = open_device(device, options);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (libevdev_get_id_vendor(device->device) != device->vendor
+			|| libevdev_get_id_product(device->device) != device->product) {
+		fprintf(stderr, "device %s does not match the original device\n", device->device_path);
+		detach(device, options, epfd);
+		return -1;
+	}
+
+	if (router->switched && options->grab) {
+		rc = libevdev_grab(device->device, LIBEVDEV_GRAB);
+		if (rc < 0) {
+			fprintf(stderr, "failed to grab device %s\n", device->device_path);
+			detach(device, options, epfd);
+			return rc;
+		}
+	}
+
+	if (options->io_uring) {
+		rc = uring_update_device(device);
+	} else {
+		rc = device_epoll_add(epfd, device);
+	}
+	if (rc < 0) {
+		fprintf(stderr, "failed to poll %s\n", device->device_path);
+		detach(device, options, epfd);
+		return rc;
+	}
+
+	if (options->verbose) {
+		printf("attached device %s\n", device->device_path);
+	}
+
+	return 0;
+}
+
+/**
+ * Watch the directories of the devices for device nodes and symlinks being created.
+ */
+int watch_devices(struct Device *head, int epfd) {
+	int rc, inotify_fd;
+	struct Device *d;
+	char *path, *directory;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		fprintf(stderr, "failed to create inotify file descriptor\n");
+		return -1;
+	}
+
+	for (d = head; d != NULL; d = d->next) {
+		path = strdup(d->device_path);
+		if (path == NULL) {
+			close(inotify_fd);
+			return -1;
+		}
+
+		directory = dirname(path);
+
+		// watching a directory twice returns the existing watch
+		rc = inotify_add_watch(inotify_fd, directory, IN_CREATE|IN_ATTRIB|IN_MOVED_TO);
+		if (rc < 0) {
+			fprintf(stderr, "failed to watch %s\n", directory);
+			free(path);
+			close(inotify_fd);
+			return rc;
+		}
+
+		free(path);
+	}
+
+	rc = epoll_add(epfd, inotify_fd, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "failed to add inotify file descriptor to epoll\n");
+		close(inotify_fd);
+		return rc;
+	}
+
+	return inotify_fd;
+}
+
+/**
+ * Create the timer that relays the summed up motion at `rate` Hz.
+ */
+int motion_timer(int epfd, long rate) {
+	int fd, rc;
+	struct itimerspec spec;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	spec.it_interval.tv_sec = 1 / rate;
+	spec.it_interval.tv_nsec = 1000000000L / rate % 1000000000L;
+	spec.it_value = spec.it_interval;
+
+	if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	rc = epoll_add(epfd, fd, NULL);
+	if (rc < 0) {
+		close(fd);
+		return rc;
+	}
+
+	return fd;
+}
+
+/**
+ * Attach detached devices whose node or symlink appeared.
+ *
+ * Device nodes are created before udev sets their permissions so a failing open is
+ * retried on the following `IN_ATTRIB` event.
+ */
+void handle_hotplug(int inotify_fd, struct Router *router, struct Options *options, int epfd) {
+	char buffer[INOTIFY_BUFFER_SIZE] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct Device *d;
+	ssize_t n;
+	char *path, *name;
+
+	while ((n = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+		for (char *p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->len == 0) {
+				continue;
+			}
+
+			for (d = router->head; d != NULL; d = d->next) {
+				if (d->device_fd != -1) {
+					continue;
+				}
+
+				path = strdup(d->device_path);
+				if (path == NULL) {
+					continue;
+				}
+
+				name = basename(path);
+				if (strcmp(name, event->name) == 0) {
+					attach(d, options, router, epfd);
+				}
+
+				free(path);
+			}
+		}
+	}
+}
+
+/**
+ * Control socket.
+ *
+ * Clients connect to a `SOCK_SEQPACKET` socket and send one command per packet, the
+ * response is sent back as one packet:
+ *
+ *   switch NAME|next  switch to a target
+ *   target            the current target
+ *   stats             the counters of every device and target
+ *   metrics           the counters in the Prometheus text format
+ *   devices           the devices and whether they are attached
+ *   tap               the memfd of the tap, see `tap_open()`
+ *
+ * The sockets are served from the epoll loop and are non-blocking, a client whose
+ * response can't be sent whole right away is disconnected so it never holds up the
+ * relay, see `control_send()`. A response that doesn't fit `CONTROL_BUFFER_SIZE`
+ * is replaced by an error instead of being cut short. Client
+ * sockets are tagged with `CONTROL_TAG` in epoll with the file descriptor in the
+ * upper half.
+ */
+#define CONTROL_TAG 2UL
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_BUFFER_SIZE 65536
+
+struct Control {
+	int fd;
+	char *path;
+	int clients[CONTROL_MAX_CLIENTS];
+	unsigned int client_count;
+
+	// the client a handoff was sent to until it acknowledges it, -1 otherwise, and
+	// the timer that gives up on it, see `control_handoff()`
+	int handoff_fd;
+	int timer_fd;
+
+	char buffer[CONTROL_BUFFER_SIZE];
+	unsigned long responses_dropped;
+};
+
+static struct Control control = { .fd = -1, .handoff_fd = -1, .timer_fd = -1 };
+
+int control_open(char *path, int epfd) {
+	int rc;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// disarmed until a handoff waits for its acknowledgement
+	control.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (control.timer_fd < 0 || epoll_add(epfd, control.timer_fd, NULL) < 0) {
+		return -errno;
+	}
+
+	// the socket taken over from the previous instance, see `takeover()`
+	if (control.fd != -1) {
+		control.path = path;
+		return epoll_add(epfd, control.fd, NULL);
+	}
+
+	control.fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (control.fd < 0) {
+		return -errno;
+	}
+
+	// a socket left behind by a previous run
+	unlink(path);
+
+	if (bind(control.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| listen(control.fd, CONTROL_MAX_CLIENTS) < 0) {
+		rc = -errno;
+		close(control.fd);
+		control.fd = -1;
+		return rc;
+	}
+
+	control.path = path;
+
+	return epoll_add(epfd, control.fd, NULL);
+}
+
+void control_accept(int epfd) {
+	int fd;
+	struct epoll_event ev;
+
+	while ((fd = accept4(control.fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+		if (control.client_count == CONTROL_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u64 = ((unsigned long) fd << 32) | CONTROL_TAG;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			continue;
+		}
+
+		control.clients[control.client_count++] = fd;
+	}
+}
+
+void control_disconnect(int fd, int epfd) {
+	struct itimerspec spec = { 0 };
+
+	if (fd == control.handoff_fd) {
+		control.handoff_fd = -1;
+		timerfd_settime(control.timer_fd, 0, &spec, NULL);
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+
+	for (unsigned int i = 0; i < control.client_count; i++) {
+		if (control.clients[i] == fd) {
+			control.clients[i] = control.clients[--control.client_count];
+			break;
+		}
+	}
+}
+
+/**
+ * Send the response in `control.buffer` to a client, a client that can't take it
+ * whole right away is disconnected. Returns false if the client is gone.
+ */
+bool control_send(int fd, size_t length, int epfd) {
+	if (length >= CONTROL_BUFFER_SIZE) {
+		length = snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error response exceeds %d bytes\n", CONTROL_BUFFER_SIZE);
+	}
+
+	if (send(fd, control.buffer, length, MSG_DONTWAIT|MSG_NOSIGNAL) != (ssize_t) length) {
+		control.responses_dropped++;
+		control_disconnect(fd, epfd);
+		return false;
+	}
+
+	return true;
+}
+
+size_t control_stats(struct Router *router, struct Options *options) {
+	struct Device *d;
+	struct DeviceTarget *t;
+	size_t n = 0;
+
+	for (d = router->head; d != NULL; d = d->next) {
+		for (unsigned int i = 0; i < d->target_count && n < CONTROL_BUFFER_SIZE; i++) {
+			t = device_target(d, i);
+			n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n,
+				"%s %s written=%lu dropped=%lu misrouted=%lu errors=%lu coalesced=%lu syn_dropped=%lu resyncs=%lu\n",
+				d->device_path,
+				target_label(options, i),
+				t->frames_written,
+				t->frames_dropped,
+				t->frames_misrouted,
+				t->write_errors,
+				t->frames_coalesced,
+				d->syn_dropped,
+				d->resyncs);
+		}
+	}
+
+	if (n < CONTROL_BUFFER_SIZE) {
+		n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n, "control responses_dropped=%lu\n",
+			control.responses_dropped);
+	}
+
+	return n;
+}
+
+/**
+ * Metrics in the Prometheus text format.
+ *
+ * The counters are only written by the event loop and read here in the same loop,
+ * so keeping them costs a plain increment on the relay path. Labels are escaped
+ * since device paths come from the command line.
+ */
+enum METRIC {
+	metric_events_read,
+	metric_syn_dropped,
+	metric_frames_written,
+	metric_bytes_written,
+	metric_write_errors,
+	metric_frames_dropped,
+	metric_frames_misrouted,
+	METRIC_CNT
+};
+
+static const char *metric_names[METRIC_CNT][2] = {
+	{ "evdevkm_events_read_total", "Events read from the device" },
+	{ "evdevkm_syn_dropped_total", "SYN_DROPPED occurrences on the device" },
+	{ "evdevkm_frames_written_total", "Frames written to the target" },
+	{ "evdevkm_bytes_written_total", "Bytes written to the target" },
+	{ "evdevkm_write_errors_total", "Failed writes to the target" },
+	{ "evdevkm_frames_dropped_total", "Frames dropped from the output queue of the target or too long for its event queue" },
+	{ "evdevkm_frames_misrouted_total", "Frames relayed to the target after the trigger of a switch away from it" },
+};
+
+size_t metrics_label(char *buffer, size_t size, const char *value) {
+	size_t n = 0;
+
+	for (; *value != '\0' && n + 2 < size; value++) {
+		if (*value == '\\' || *value == '"') {
+			buffer[n++] = '\\';
+		} else if (*value == '\n') {
+			buffer[n++] = '\\';
+			buffer[n++] = 'n';
+			continue;
+		}
+		buffer[n++] = *value;
+	}
+	buffer[n] = '\0';
+
+	return n;
+}
+
+unsigned long metric_value(enum METRIC metric, struct Device *d, struct DeviceTarget *t) {
+	switch (metric) {
+		case metric_events_read:
+			return d->events_read;
+		case metric_syn_dropped:
+			return d->syn_dropped;
+		case metric_frames_written:
+			return t->frames_written;
+		case metric_bytes_written:
+			return t->bytes_written;
+		case metric_write_errors:
+			return t->write_errors;
+		case metric_frames_dropped:
+			return t->frames_dropped;
+		case metric_frames_misrouted:
+			return t->frames_misrouted;
+		default:
+			return 0;
+	}
+}
+
+size_t control_metrics(struct Router *router, struct Options *options) {
+	struct Device *d;
+	struct DeviceTarget *t;
+	char label[PATH_MAX * 2];
+	size_t n = 0;
+
+	for (enum METRIC m = 0; m < METRIC_CNT; m++) {
+		n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n, "# HELP %s %s\n# TYPE %s counter\n",
+			metric_names[m][0], metric_names[m][1], metric_names[m][0]);
+
+		for (d = router->head; d != NULL && n < CONTROL_BUFFER_SIZE; d = d->next) {
+			metrics_label(label, sizeof(label), d->device_path);
+
+			// the counters of the device come before those of its targets
+			if (m < metric_frames_written) {
+				n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n, "%s{device=\"%s\"} %lu\n",
+					metric_names[m][0], label, metric_value(m, d, NULL));
+				continue;
+			}
+
+			for (unsigned int i = 0; i < d->target_count && n < CONTROL_BUFFER_SIZE; i++) {
+				n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n, "%s{device=\"%s\",target=\"%s\"} %lu\n",
+					metric_names[m][0], label, target_label(options, i), metric_value(m, d, device_target(d, i)));
+			}
+		}
+
+		if (n >= CONTROL_BUFFER_SIZE) {
+			return n;
+		}
+	}
+
+	n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n,
+		"# HELP evdevkm_switch_first_frame_seconds Time from the trigger of a switch, or the later timestamp of the frame, to the first frame of the device on the target\n"
+		"# TYPE evdevkm_switch_first_frame_seconds summary\n");
+
+	for (d = router->head; d != NULL && n < CONTROL_BUFFER_SIZE; d = d->next) {
+		metrics_label(label, sizeof(label), d->device_path);
+
+		for (unsigned int i = 0; i < d->target_count && n < CONTROL_BUFFER_SIZE; i++) {
+			t = device_target(d, i);
+
+			n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n,
+				"evdevkm_switch_first_frame_seconds{device=\"%s\",target=\"%s\",quantile=\"0.5\"} %.9f\n"
+				"evdevkm_switch_first_frame_seconds{device=\"%s\",target=\"%s\",quantile=\"0.99\"} %.9f\n"
+				"evdevkm_switch_first_frame_seconds_sum{device=\"%s\",target=\"%s\"} %.9f\n"
+				"evdevkm_switch_first_frame_seconds_count{device=\"%s\",target=\"%s\"} %lu\n",
+				label, target_label(options, i), histogram_percentile(t->switch_latency, 50.0) / 1e9,
+				label, target_label(options, i), histogram_percentile(t->switch_latency, 99.0) / 1e9,
+				label, target_label(options, i), t->switch_latency_ns / 1e9,
+				label, target_label(options, i), t->switch_latency->count);
+		}
+	}
+
+	if (n >= CONTROL_BUFFER_SIZE) {
+		return n;
+	}
+
+	n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n,
+		"# HELP evdevkm_switches_total Switches between targets\n"
+		"# TYPE evdevkm_switches_total counter\n"
+		"evdevkm_switches_total %lu\n"
+		"# HELP evdevkm_switch_latency_seconds Time from the trigger event to the end of the switch\n"
+		"# TYPE evdevkm_switch_latency_seconds summary\n"
+		"evdevkm_switch_latency_seconds_sum %.9f\n"
+		"evdevkm_switch_latency_seconds_count %lu\n"
+		"# HELP evdevkm_switch_latency_max_seconds Longest time from the trigger event to the end of a switch\n"
+		"# TYPE evdevkm_switch_latency_max_seconds gauge\n"
+		"evdevkm_switch_latency_max_seconds %.9f\n"
+		"# HELP evdevkm_control_responses_dropped_total Control responses that could not be sent, the client was disconnected\n"
+		"# TYPE evdevkm_control_responses_dropped_total counter\n"
+		"evdevkm_control_responses_dropped_total %lu\n",
+		router->switches,
+		router->switch_ns / 1e9,
+		router->switches,
+		router->switch_ns_max / 1e9,
+		control.responses_dropped);
+
+	return n;
+}
+
+/**
+ * The grabbed devices and the tap are only handed to a client of the same user.
+ */
+bool control_trusted(int fd) {
+	struct ucred cred;
+	socklen_t length = sizeof(cred);
+
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0 && cred.uid == geteuid();
+}
+
+/**
+ * Hand the memfd of the tap to a client, the reply carries the capacity.
+ */
+bool control_tap(int fd, int epfd) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	size_t length;
+
+	if (tap.fd == -1) {
+		length = snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error tap is not enabled\n");
+		return control_send(fd, length, epfd);
+	}
+
+	length = snprintf(control.buffer, CONTROL_BUFFER_SIZE, "ok %u\n", tap.capacity);
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = control.buffer;
+	iov.iov_len = length;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buffer;
+	msg.msg_controllen = sizeof(u.buffer);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &tap.fd, sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL) != (ssize_t) length) {
+		control.responses_dropped++;
+		control_disconnect(fd, epfd);
+		return false;
+	}
+
+	return true;
+}
+
+size_t control_devices(struct Router *router) {
+	struct Device *d;
+	size_t n = 0;
+
+	for (d = router->head; d != NULL && n < CONTROL_BUFFER_SIZE; d = d->next) {
+		n += snprintf(control.buffer + n, CONTROL_BUFFER_SIZE - n, "%s %s %04x:%04x\n",
+			d->device_path,
+			d->device_fd != -1 ? "attached" : "detached",
+			d->vendor,
+			d->product);
+	}
+
+	return n;
+}
+
+size_t control_switch(struct Router *router, struct Options *options, char *name) {
+	int target;
+	char unknown[64];
+	struct input_event trigger;
+	struct timespec now;
+
+	if (strcmp(name, "next") == 0) {
+		target = switch_next(router, options);
+	} else {
+		target = target_index(options, name);
+		if (target < 0) {
+			// `name` points into `control.buffer`, the reply is written over it
+			snprintf(unknown, sizeof(unknown), "%s", name);
+			return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error %s is not a target\n", unknown);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	memset(&trigger, 0, sizeof(trigger));
+	trigger.input_event_sec = now.tv_sec;
+	trigger.input_event_usec = now.tv_nsec / 1000;
+
+	// a switch from the control socket is not part of a frame and applied right away
+	switch_request(router, target, &trigger, KEY_CNT);
+	if (switch_apply(router, options) < 0) {
+		return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error failed to switch\n");
+	}
+
+	return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "ok %s\n", target_label(options, target));
+}
+
+/**
+ * Handoff to a new instance.
+ *
+ * A new instance started with `--takeover` sends `handoff` on the control socket of
+ * the running instance, which passes everything that must survive the restart with
+ * `SCM_RIGHTS`: the control socket with a `HandoffHeader` that carries the current
+ * target, then a `HandoffDevice` per device with the grabbed device file descriptor
+ * and the uinput file descriptors or vhost-user sockets of its targets. The evdev
+ * and uinput file descriptions are shared, so the grab and the device nodes survive
+ * and events that arrive in between stay queued on the device. The running instance
+ * relays on until the new one acknowledges with `ok`, which it sends only once it
+ * has adopted everything, and then exits without destroying what it handed over.
+ * The new instance reads nothing before the connection is closed by that exit. An
+ * acknowledgement that doesn't come within `HANDOFF_ACK_TIMEOUT_MS` is refused with
+ * an error, which the new instance waits for as well, and relaying carries on.
+ * The target and the held keys are those at the time of the handoff.
+ */
+struct HandoffHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t target_count;
+	uint32_t device_count;
+	uint32_t target;
+	uint32_t switched;
+	// bit per target that is a vhost-user target
+	uint32_t vhost;
+	uint32_t reserved;
+	char targets[MAX_TARGETS][HANDOFF_NAME_LENGTH];
+};
+
+struct HandoffDevice {
+	char path[HANDOFF_PATH_LENGTH];
+	unsigned long keys[NLONGS(KEY_CNT)];
+	unsigned long released[NLONGS(KEY_CNT)];
+};
+
+int handoff_send(int fd, void *data, size_t length, int *fds, unsigned int fd_count) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buffer[CMSG_SPACE((1 + MAX_TARGETS) * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = length;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buffer;
+	msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) length) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * Receive a packet of at most `length` bytes within `timeout` milliseconds, returns
+ * its length. The file descriptors that come with it are stored in `fds`.
+ */
+ssize_t handoff_receive(int fd, void *data, size_t length, int *fds, unsigned int *fd_count, int timeout) {
+	ssize_t n;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buffer[CMSG_SPACE((1 + MAX_TARGETS) * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+
+	*fd_count = 0;
+
+	if (poll(&pfd, 1, timeout) != 1) {
+		return -ETIMEDOUT;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = length;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buffer;
+	msg.msg_controllen = sizeof(u.buffer);
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0) {
+		return -errno;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *fd_count * sizeof(int));
+		}
+	}
+
+	if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+		for (unsigned int i = 0; i < *fd_count; i++) {
+			close(fds[i]);
+		}
+		*fd_count = 0;
+		return -EMSGSIZE;
+	}
+
+	return n;
+}
+
+/**
+ * Write out the motion summed up and as many of the frames queued for the targets
+ * as the guests have buffers for without waiting, the new instance starts with empty
+ * queues.
+ */
+void handoff_flush(struct Router *router, struct Options *options) {
+	struct Device *d;
+	struct DeviceTarget *t;
+
+	for (d = router->head; d != NULL; d = d->next) {
+		motion_flush_device(d, options);
+
+		for (unsigned int i = 0; i < d->target_count; i++) {
+			t = device_target(d, i);
+
+			// only a vhost-user target queues frames
+			if (t->queue_head != t->queue_tail) {
+				queue_drain(t, options);
+			}
+		}
+	}
+}
+
+/**
+ * Send the handoff to a client. Nothing is replied, the client is served as the
+ * handoff in progress until it acknowledges, see `control_handoff_ack()`.
+ */
+
+size_t control_handoff(int fd, struct Router *router, struct Options *options) {
+	int rc, fds[1 + MAX_TARGETS];
+	unsigned int count = 0;
+	struct HandoffHeader header;
+	struct HandoffDevice device;
+	struct Device *d;
+	struct DeviceTarget *t;
+	struct itimerspec spec = { 0 };
+
+	if (control.handoff_fd != -1) {
+		return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error handoff in progress\n");
+	}
+
+	// reads in flight on the ring would take events from the new instance
+	if (options->io_uring) {
+		return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error handoff is not supported with io_uring\n");
+	}
+
+	for (d = router->head; d != NULL; d = d->next, count++) {
+		if (d->device_fd == -1) {
+			return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error %s is detached\n", d->device_path);
+		}
+
+		if (strlen(d->device_path) >= HANDOFF_PATH_LENGTH) {
+			return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error %s is too long\n", d->device_path);
+		}
+	}
+
+	// the target handed over is the one after a pending switch
+	switch_apply(router, options);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = HANDOFF_MAGIC;
+	header.version = HANDOFF_VERSION;
+	header.target_count = options->target_count;
+	header.device_count = count;
+	header.target = router->target;
+	header.switched = router->switched;
+
+	for (unsigned int i = 0; i < options->target_count; i++) {
+		if (strlen(options->target_names[i]) >= HANDOFF_NAME_LENGTH) {
+			return snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error %s is too long\n", options->target_names[i]);
+		}
+		strcpy(header.targets[i], options->target_names[i]);
+
+		if (options->vhost_dirs[i] != NULL) {
+			header.vhost |= 1U << i;
+		}
+	}
+
+	// the client socket is non-blocking, the handoff is a few small packets
+	rc = handoff_send(fd, &header, sizeof(header), &control.fd, 1);
+
+	for (d = router->head; d != NULL && rc == 0; d = d->next) {
+		memset(&device, 0, sizeof(device));
+		strcpy(device.path, d->device_path);
+		memcpy(device.keys, d->keys, sizeof(device.keys));
+		memcpy(device.released, d->released, sizeof(device.released));
+
+		fds[0] = d->device_fd;
+		for (unsigned int i = 0; i < d->target_count; i++) {
+			t = device_target(d, i);
+			fds[1 + i] = t->vhost != NULL ? t->vhost->listen_fd : t->fd;
+		}
+
+		rc = handoff_send(fd, &device, sizeof(device), fds, 1 + d->target_count);
+	}
+
+	// the new instance initializes everything it took over before it acknowledges,
+	// meanwhile the relay goes on
+	spec.it_value.tv_nsec = HANDOFF_ACK_TIMEOUT_MS * 1000000L;
+	if (rc == 0 && timerfd_settime(control.timer_fd, 0, &spec, NULL) < 0) {
+		rc = -errno;
+	}
+
+	if (rc < 0) {
+		fprintf(stderr, "failed to hand over (%d)\n", rc);
+		return 0;
+	}
+
+	control.handoff_fd = fd;
+
+	return 0;
+}
+
+/**
+ * Refuse the acknowledgement of the handoff in progress, the new instance exits and
+ * this one keeps the devices.
+ */
+void control_handoff_abort(int epfd) {
+	char *error = "error handoff was not acknowledged\n";
+
+	send(control.handoff_fd, error, strlen(error), MSG_DONTWAIT|MSG_NOSIGNAL);
+	fprintf(stderr, "handoff was not acknowledged, relaying on\n");
+
+	control_disconnect(control.handoff_fd, epfd);
+}
+
+/**
+ * Read the acknowledgement of the handoff in progress. On `ok` the devices are left
+ * to the new instance, which waits for this one to exit, see `takeover_ack()`.
+ */
+void control_handoff_ack(int fd, struct Router *router, struct Options *options, int epfd) {
+	ssize_t n;
+	char reply[4];
+
+	n = recv(fd, reply, sizeof(reply), MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+
+	if (n != 2 || strncmp(reply, "ok", 2) != 0) {
+		control_handoff_abort(epfd);
+		return;
+	}
+
+	handoff_flush(router, options);
+	handed_off = true;
+
+	if (options->verbose) {
+		printf("handed over %u devices\n", device_table.count);
+	}
+}
+
+/**
+ * Give up on the handoff in progress once `HANDOFF_ACK_TIMEOUT_MS` passed.
+ */
+void control_handoff_expire(int epfd) {
+	uint64_t ticks;
+
+	if (read(control.timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks) && control.handoff_fd != -1) {
+		control_handoff_abort(epfd);
+	}
+}
+
+/**
+ * Take over the devices and targets of the instance at the control socket path.
+ *
+ * Every device of the running instance must be given to this one, with the same
+ * targets, as the handoff is all or nothing. The devices are matched by path and
+ * their file descriptors are adopted by `open_device()` and `create_target()`. The
+ * connection is kept in `takeover_fd` until `takeover_ack()` once they are adopted.
+ */
+int takeover(struct Device *head, struct Options *options, struct Router *router) {
+	int rc = 0, fd, fds[1 + MAX_TARGETS];
+	unsigned int fd_count, vhost = 0, i;
+	ssize_t n;
+	struct sockaddr_un addr;
+	struct HandoffHeader header;
+	struct HandoffDevice device;
+	struct Device *d;
+	char *error = NULL;
+
+	if (strlen(options->control_path) >= sizeof(addr.sun_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, options->control_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || send(fd, "handoff", 7, MSG_NOSIGNAL) < 0) {
+		rc = -errno;
+		close(fd);
+		return rc;
+	}
+
+	n = handoff_receive(fd, &header, sizeof(header), fds, &fd_count, HANDOFF_TIMEOUT_MS);
+	if (n != sizeof(header) || header.magic != HANDOFF_MAGIC) {
+		// a refusal is a line of text
+		if (n > 0 && fd_count == 0) {
+			fprintf(stderr, "%.*s", (int) n, (char *) &header);
+		}
+		for (i = 0; i < fd_count; i++) {
+			close(fds[i]);
+		}
+		close(fd);
+		return n < 0 ? n : -EPROTO;
+	}
+
+	control.fd = fd_count == 1 ? fds[0] : -1;
+
+	for (i = 0; i < options->target_count; i++) {
+		if (options->vhost_dirs[i] != NULL) {
+			vhost |= 1U << i;
+		}
+	}
+
+	if (header.version != HANDOFF_VERSION || fd_count != 1) {
+		error = "error version mismatch\n";
+	} else if (header.target_count != options->target_count || header.vhost != vhost) {
+		error = "error targets do not match\n";
+	}
+
+	for (i = 0; i < options->target_count && error == NULL; i++) {
+		if (strncmp(header.targets[i], options->target_names[i], HANDOFF_NAME_LENGTH) != 0) {
+			error = "error targets do not match\n";
+		}
+	}
+
+	for (i = 0, d = head; d != NULL; d = d->next) {
+		i++;
+	}
+	if (error == NULL && header.device_count != i) {
+		error = "error devices do not match\n";
+	}
+
+	for (i = 0; i < header.device_count && error == NULL; i++) {
+		n = handoff_receive(fd, &device, sizeof(device), fds, &fd_count, HANDOFF_TIMEOUT_MS);
+		if (n != sizeof(device) || fd_count != 1 + options->target_count) {
+			error = "error invalid device\n";
+		}
+
+		for (d = head; d != NULL && error == NULL; d = d->next) {
+			if (strncmp(d->device_path, device.path, HANDOFF_PATH_LENGTH) == 0 && d->device_fd == -1) {
+				break;
+			}
+		}
+
+		if (error == NULL && (d == NULL || create_targets(d, options->target_count) < 0)) {
+			error = "error devices do not match\n";
+		}
+
+		if (error != NULL) {
+			for (unsigned int j = 0; j < fd_count; j++) {
+				close(fds[j]);
+			}
+			break;
+		}
+
+		d->device_fd = fds[0];
+		memcpy(d->keys, device.keys, sizeof(d->keys));
+		memcpy(d->released, device.released, sizeof(d->released));
+
+		for (unsigned int j = 0; j < options->target_count; j++) {
+			device_target(d, j)->takeover_fd = fds[1 + j];
+		}
+	}
+
+	if (error != NULL) {
+		send(fd, error, strlen(error), MSG_NOSIGNAL);
+		fprintf(stderr, "%s", error + strlen("error "));
+		close(fd);
+
+		// the control socket stays with the running instance
+		if (control.fd != -1) {
+			close(control.fd);
+			control.fd = -1;
+		}
+
+		return -EPROTO;
+	}
+
+	router->target = header.target;
+	router->switched = header.switched;
+	takeover_fd = fd;
+
+	return rc;
+}
+
+/**
+ * Acknowledge the takeover once everything handed over is adopted and wait for the
+ * previous instance to exit on `ok`. If it can't be told or refuses it relays on and
+ * keeps the devices.
+ */
+int takeover_ack(struct Options *options, struct Router *router) {
+	int rc = 0, fds[1 + MAX_TARGETS];
+	unsigned int fd_count;
+	ssize_t n;
+	char reply[64];
+
+	if (takeover_fd == -1) {
+		return 0;
+	}
+
+	if (send(takeover_fd, "ok", 2, MSG_NOSIGNAL) < 0) {
+		rc = -errno;
+		takeover_refuse();
+		return rc;
+	}
+
+	// the previous instance relays until it exits, which closes the connection, or
+	// refuses an acknowledgement that came too late, see `control_handoff_ack()`
+	n = handoff_receive(takeover_fd, reply, sizeof(reply), fds, &fd_count, HANDOFF_TIMEOUT_MS);
+	if (n != 0) {
+		if (n > 0) {
+			fprintf(stderr, "%.*s", (int) n, reply);
+		}
+		for (unsigned int i = 0; i < fd_count; i++) {
+			close(fds[i]);
+		}
+		takeover_refuse();
+		return n < 0 ? n : -EPROTO;
+	}
+
+	close(takeover_fd);
+	takeover_fd = -1;
+
+	if (options->verbose) {
+		printf("took over %u devices on %s\n", device_table.count, target_label(options, router->target));
+	}
+
+	return 0;
+}
+
+/**
+ * Refuse a takeover that fails after the handoff was received. The previous instance
+ * relays on, so what was adopted is only closed and neither destroyed nor unlinked.
+ */
+void takeover_refuse() {
+	char *error = "error failed to initialize\n";
+
+	if (takeover_fd == -1) {
+		return;
+	}
+
+	send(takeover_fd, error, strlen(error), MSG_NOSIGNAL);
+	close(takeover_fd);
+	takeover_fd = -1;
+
+	handed_off = true;
+}
+
+/**
+ * Read and answer the commands of a client.
+ */
+void control_handle(int fd, struct Router *router, struct Options *options, int epfd) {
+	ssize_t n;
+	size_t length;
+
+	// the only thing a client that got the handoff sends is its acknowledgement
+	if (fd == control.handoff_fd) {
+		control_handoff_ack(fd, router, options, epfd);
+		return;
+	}
+
+	while (true) {
+		n = recv(fd, control.buffer, CONTROL_BUFFER_SIZE - 1, MSG_DONTWAIT);
+		if (n < 0 && errno == EAGAIN) {
+			return;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			control_disconnect(fd, epfd);
+			return;
+		}
+
+		// commands may end with a newline when sent from a shell
+		while (n > 0 && (control.buffer[n - 1] == '\n' || control.buffer[n - 1] == ' ')) {
+			n--;
+		}
+		control.buffer[n] = '\0';
+
+		if (strncmp(control.buffer, "switch ", 7) == 0) {
+			length = control_switch(router, options, control.buffer + 7);
+		} else if (strcmp(control.buffer, "target") == 0) {
+			length = snprintf(control.buffer, CONTROL_BUFFER_SIZE, "%s\n", target_label(options, router->target));
+		} else if (strcmp(control.buffer, "stats") == 0) {
+			length = control_stats(router, options);
+		} else if ((strcmp(control.buffer, "handoff") == 0 || strcmp(control.buffer, "tap") == 0)
+				&& !control_trusted(fd)) {
+			length = snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error permission denied\n");
+		} else if (strcmp(control.buffer, "handoff") == 0) {
+			length = control_handoff(fd, router, options);
+			if (length == 0) {
+				// a new instance that didn't get the handoff must not acknowledge it
+				if (fd != control.handoff_fd) {
+					control_disconnect(fd, epfd);
+				}
+				return;
+			}
+		} else if (strcmp(control.buffer, "tap") == 0) {
+			if (!control_tap(fd, epfd)) {
+				return;
+			}
+			continue;
+		} else if (strcmp(control.buffer, "metrics") == 0) {
+			length = control_metrics(router, options);
+		} else if (strcmp(control.buffer, "devices") == 0) {
+			length = control_devices(router);
+		} else {
+			length = snprintf(control.buffer, CONTROL_BUFFER_SIZE, "error unknown command\n");
+		}
+
+		if (!control_send(fd, length, epfd)) {
+			return;
+		}
+	}
+}
+
+void control_close() {
+	for (unsigned int i = 0; i < control.client_count; i++) {
+		close(control.clients[i]);
+	}
+	control.client_count = 0;
+
+	control.handoff_fd = -1;
+
+	if (control.timer_fd != -1) {
+		close(control.timer_fd);
+		control.timer_fd = -1;
+	}
+
+	if (control.fd != -1) {
+		close(control.fd);
+		if (!handed_off) {
+			unlink(control.path);
+		}
+		control.fd = -1;
+	}
+}
+
+int create(struct Device **device, char *device_path) {
+	int rc;
+	struct Device *d;
+
+	d = aligned_alloc(DEVICE_ALIGNMENT, sizeof(struct Device));
+	if (d == NULL) {
+		return -1;
+	}
+
+	d->device_path = malloc(strlen(device_path)+1);
+	if (d->device_path == NULL) {
+		return -1;
+	}
+
+	strcpy(d->device_path, device_path);
+
+	d->device_fd = -1;
+	d->device = NULL;
+
+	memset(d->keys, 0, sizeof(d->keys));
+	memset(d->released, 0, sizeof(d->released));
+	d->switch_to = -1;
+	hotkey_reset(d);
+
+	memset(d->abs, 0, sizeof(d->abs));
+	d->mt = NULL;
+	d->mt_slots = -1;
+	d->slot = 0;
+	d->raw_events = NULL;
+	d->events_read = 0;
+	d->syn_dropped = 0;
+	d->resyncs = 0;
+	d->resync_ns = 0;
+	d->resync_ns_max = 0;
+
+	// the targets are created once the options are parsed, see `create_targets()`
+	d->targets = NULL;
+	d->target_count = 0;
+
+	d->next = NULL;
+
+	(*device) = d;
+
+	return 0;
+}
+
+/**
+ * Append a device in constant time, `*tail` is the last device of the list.
+ */
+void append(struct Device **head, struct Device **tail, struct Device *device) {
+	device->index = *tail != NULL ? (*tail)->index + 1 : 0;
+	device->next = NULL;
+
+	if (*tail != NULL) {
+		(*tail)->next = device;
+	} else {
+		*head = device;
+	}
+
+	*tail = device;
+}
+
+/**
+ * Free the devices and their targets. The uinput devices and vhost-user sockets
+ * are destroyed unless they were handed over to a new instance, see `handed_off`.
+ */
 void free_all_devices(struct Device *head) {
 	struct Device *d;
 
-	if (head != NULL) {
-		do {
-			d = head;
-			head = head->next;
+	if (head != NULL) {
+		do {
+			d = head;
+			head = head->next;
+
+			free_device(d);
+			d = NULL;
+		} while (head != NULL);
+	}
+
+	device_table_free();
+}
+
+/**
+ * Move the devices given on the command line into one contiguous table.
+ *
+ * The devices are read on every event, with many devices a walk of the list
+ * or a lookup on dispatch touches one cache line per device. In the table each
+ * device starts on its own cache line and epoll hands back the index of the
+ * device, see `device_epoll_add()`. The list is kept as a view of the table
+ * in order of the index, the table is never resized once it is built.
+ */
+int device_table_build(struct Device **head) {
+	struct Device *d, *next, *devices;
+	unsigned int count = 0, i;
+
+	for (d = *head; d != NULL; d = d->next) {
+		count++;
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+	devices = aligned_alloc(DEVICE_ALIGNMENT, count * sizeof(struct Device));
+	if (devices == NULL) {
+		return -1;
+	}
+
+	for (d = *head, i = 0; d != NULL; d = next, i++) {
+		next = d->next;
+
+		memcpy(&devices[i], d, sizeof(struct Device));
+		devices[i].index = i;
+		devices[i].next = i + 1 < count ? &devices[i + 1] : NULL;
+
+		free(d);
+	}
+
+	device_table.devices = devices;
+	device_table.count = count;
+	*head = devices;
+
+	return 0;
+}
+
+void trace_put_capabilities(FILE *f, struct libevdev *dev) {
+	const struct input_absinfo *abs;
+	int max;
+
+	trace_put_varint(f, libevdev_get_id_bustype(dev));
+	trace_put_varint(f, libevdev_get_id_vendor(dev));
+	trace_put_varint(f, libevdev_get_id_product(dev));
+	trace_put_varint(f, libevdev_get_id_version(dev));
+
+	for (unsigned int prop = 0; prop < INPUT_PROP_CNT; prop++) {
+		if (libevdev_has_property(dev, prop)) {
+			trace_put_varint(f, prop + 1);
+		}
+	}
+	trace_put_varint(f, 0);
+
+	for (unsigned int type = 0; type < EV_CNT; type++) {
+		max = libevdev_event_type_get_max(type);
+		if (max < 0 || !libevdev_has_event_type(dev, type)) {
+			continue;
+		}
+
+		trace_put_varint(f, type + 1);
+
+		for (unsigned int code = 0; code <= (unsigned int) max; code++) {
+			if (!libevdev_has_event_code(dev, type, code)) {
+				continue;
+			}
+
+			trace_put_varint(f, code + 1);
+
+			if (type == EV_ABS) {
+				abs = libevdev_get_abs_info(dev, code);
+				trace_put_varint(f, zigzag_encode(abs->minimum));
+				trace_put_varint(f, zigzag_encode(abs->maximum));
+				trace_put_varint(f, zigzag_encode(abs->fuzz));
+				trace_put_varint(f, zigzag_encode(abs->flat));
+				trace_put_varint(f, zigzag_encode(abs->resolution));
+			} else if (type == EV_REP) {
+				trace_put_varint(f, zigzag_encode(libevdev_get_event_value(dev, type, code)));
+			}
+		}
+		trace_put_varint(f, 0);
+	}
+	trace_put_varint(f, 0);
+}
+
+/**
+ * Start a trace, `clock` is the clock the devices timestamp their events with.
+ */
+int trace_open(struct Device *head, char *path, clockid_t clock) {
+	struct Device *d;
+	unsigned int count = 0;
+	struct timespec now;
+
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		fprintf(stderr, "failed to open trace %s\n", path);
+		return -1;
+	}
+
+	setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	for (d = head; d != NULL; d = d->next) {
+		count++;
+	}
+
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+	trace_put_varint(trace_file, count);
+
+	for (d = head; d != NULL; d = d->next) {
+		trace_put_string(trace_file, d->device_path);
+		trace_put_string(trace_file, libevdev_get_name(d->device));
+		trace_put_capabilities(trace_file, d->device);
+	}
+
+	// deltas of the first records are relative to the start of the recording,
+	// taken from the device clock as a base from another clock makes them negative
+	clock_gettime(clock, &now);
+	trace_last_us = now.tv_sec * 1000000L + now.tv_nsec / 1000;
+	trace_put_varint(trace_file, trace_last_us);
+
+	return 0;
+}
+
+void trace_close() {
+	if (trace_file != NULL) {
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+}
+
+struct TraceReader {
+	const unsigned char *p;
+	const unsigned char *end;
+	bool failed;
+};
+
+unsigned long trace_get_varint(struct TraceReader *r) {
+	unsigned long value = 0;
+	unsigned int shift = 0;
+
+	while (r->p < r->end && shift < 64) {
+		value |= (unsigned long) (*r->p & 0x7f) << shift;
+		if ((*r->p++ & 0x80) == 0) {
+			return value;
+		}
+		shift += 7;
+	}
+
+	r->failed = true;
+	return 0;
+}
+
+char *trace_get_string(struct TraceReader *r) {
+	unsigned long length = trace_get_varint(r);
+	char *s;
+
+	if (r->failed || length > (unsigned long) (r->end - r->p)) {
+		r->failed = true;
+		return NULL;
+	}
+
+	s = malloc(length + 1);
+	if (s == NULL) {
+		r->failed = true;
+		return NULL;
+	}
+
+	memcpy(s, r->p, length);
+	s[length] = '\0';
+	r->p += length;
+
+	return s;
+}
+
+/**
+ * Read the next event record, `us` is advanced by its time and `index` is set to
+ * the index of its device.
+ */
+int trace_get_event(struct TraceReader *r, long *us, unsigned long *index, struct input_event *ev) {
+	*us += trace_get_varint(r);
+	*index = trace_get_varint(r);
+	if (r->failed || r->p >= r->end) {
+		r->failed = true;
+		return -1;
+	}
+
+	ev->type = *r->p++;
+	ev->code = trace_get_varint(r);
+	ev->value = zigzag_decode(trace_get_varint(r));
+
+	return r->failed ? -1 : 0;
+}
+
+int trace_get_capabilities(struct TraceReader *r, struct libevdev *dev) {
+	unsigned long type, code, prop;
+	struct input_absinfo abs;
+	int value;
+
+	libevdev_set_id_bustype(dev, trace_get_varint(r));
+	libevdev_set_id_vendor(dev, trace_get_varint(r));
+	libevdev_set_id_product(dev, trace_get_varint(r));
+	libevdev_set_id_version(dev, trace_get_varint(r));
+
+	while (!r->failed && (prop = trace_get_varint(r)) != 0) {
+		libevdev_enable_property(dev, prop - 1);
+	}
+
+	while (!r->failed && (type = trace_get_varint(r)) != 0) {
+		type--;
+		libevdev_enable_event_type(dev, type);
+
+		while (!r->failed && (code = trace_get_varint(r)) != 0) {
+			code--;
+
+			if (type == EV_ABS) {
+				memset(&abs, 0, sizeof(abs));
+				abs.minimum = zigzag_decode(trace_get_varint(r));
+				abs.maximum = zigzag_decode(trace_get_varint(r));
+				abs.fuzz = zigzag_decode(trace_get_varint(r));
+				abs.flat = zigzag_decode(trace_get_varint(r));
+				abs.resolution = zigzag_decode(trace_get_varint(r));
+				libevdev_enable_event_code(dev, type, code, &abs);
+			} else if (type == EV_REP) {
+				value = zigzag_decode(trace_get_varint(r));
+				libevdev_enable_event_code(dev, type, code, &value);
+			} else {
+				libevdev_enable_event_code(dev, type, code, NULL);
+			}
+		}
+	}
+
+	return r->failed ? -1 : 0;
+}
+
+void sleep_until_us(long us) {
+	struct timespec ts = { .tv_sec = us / 1000000L, .tv_nsec = (us % 1000000L) * 1000L };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/**
+ * Replay the recovery from `SYN_DROPPED`.
+ *
+ * The records after it up to `SYN_REPORT` are the delta the resync relayed, see
+ * `resync_append()`. The replayed device never feeds libevdev, so libevdev is set
+ * to the state last relayed and the delta is applied on top. `resync_delta()` then
+ * relays the difference as it does for a device, and `SYN_DROPPED` itself is never
+ * relayed.
+ */
+int replay_resync(struct Device *device, struct Options *options, struct Router *router,
+		struct TraceReader *r, long *trace_us, unsigned long trace_index, struct input_event *trigger) {
+	int rc, slot = device->slot;
+	unsigned long index;
+	struct input_event ev;
+	struct timespec start;
+	long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (unsigned int code = 0; code <= KEY_MAX; code++) {
+		if (libevdev_has_event_code(device->device, EV_KEY, code)) {
+			libevdev_set_event_value(device->device, EV_KEY, code,
+				(device->keys[code / BITS_PER_LONG] >> (code % BITS_PER_LONG)) & 1);
+		}
+	}
+
+	for (unsigned int code = 0; code <= ABS_MAX; code++) {
+		if (code >= ABS_MT_SLOT && code <= ABS_MT_TOOL_Y) {
+			continue;
+		}
+
+		if (libevdev_has_event_code(device->device, EV_ABS, code)) {
+			libevdev_set_event_value(device->device, EV_ABS, code, device->abs[code]);
+		}
+	}
+
+	for (int s = 0; s < device->mt_slots; s++) {
+		for (unsigned int code = ABS_MT_SLOT + 1; code <= ABS_MT_TOOL_Y; code++) {
+			if (libevdev_has_event_code(device->device, EV_ABS, code)) {
+				libevdev_set_slot_value(device->device, s, code, device->mt[s][code - ABS_MT_SLOT]);
+			}
+		}
+	}
+
+	while (true) {
+		// the delta is recorded right after `SYN_DROPPED` of the same device
+		if (trace_get_event(r, trace_us, &index, &ev) < 0 || index != trace_index) {
+			return -EPROTO;
+		}
+
+		if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+			break;
+		}
+
+		if (ev.type == EV_KEY && ev.code <= KEY_MAX) {
+			libevdev_set_event_value(device->device, EV_KEY, ev.code, ev.value);
+		} else if (ev.type == EV_ABS && ev.code == ABS_MT_SLOT) {
+			slot = ev.value;
+		} else if (ev.type == EV_ABS && ev.code > ABS_MT_SLOT && ev.code <= ABS_MT_TOOL_Y) {
+			if (slot >= 0 && slot < device->mt_slots) {
+				libevdev_set_slot_value(device->device, slot, ev.code, ev.value);
+			}
+		} else if (ev.type == EV_ABS && ev.code <= ABS_MAX) {
+			libevdev_set_event_value(device->device, EV_ABS, ev.code, ev.value);
+		}
+	}
+
+	if (device->mt_slots > 0) {
+		libevdev_set_event_value(device->device, EV_ABS, ABS_MT_SLOT, slot);
+	}
+
+	rc = resync_delta(device, options, device_target(device, router->target), trigger);
+
+	ns = elapsed_ns(&start);
+	device->resyncs++;
+	device->resync_ns += ns;
+	if (ns > device->resync_ns_max) {
+		device->resync_ns_max = ns;
+	}
+
+	return rc;
+}
+
+/**
+ * Replay a trace through `switch_and_relay_event()`.
+ *
+ * The devices are recreated from the capabilities in the trace and their targets are
+ * created as for physical devices. Events are replayed at the original timing unless
+ * `options->replay_fast` is set. The event timestamps are replaced with the time the
+ * event is replayed so that latency measurements cover the relay only.
+ */
+int replay(struct Device **head, struct Options *options) {
+	int rc, fd;
+	struct stat st;
+	struct TraceReader r;
+	struct Device *d, *tail, **devices = NULL;
+	struct input_event ev;
+	struct timespec now;
+	unsigned long count, index;
+	long start_us, base_us, trace_us, now_us;
+	void *data;
+	char *path, *name;
+	struct Router router = { .target = 0, .switched = false, .head = NULL, .pending = -1, .pending_from = -1, .switches = 0 };
+
+	fd = open(options->replay_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "failed to open trace %s\n", options->replay_path);
+		return -1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "failed to map trace %s\n", options->replay_path);
+		return -1;
+	}
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	r.p = data;
+	r.end = r.p + st.st_size;
+	r.failed = false;
+
+	if (st.st_size < (off_t) strlen(TRACE_MAGIC) || memcmp(r.p, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0) {
+		fprintf(stderr, "%s is not a trace\n", options->replay_path);
+		rc = -1;
+		goto out;
+	}
+	r.p += strlen(TRACE_MAGIC);
+
+	for (tail = *head; tail != NULL && tail->next != NULL; tail = tail->next);
+
+	count = trace_get_varint(&r);
+	devices = calloc(count, sizeof(struct Device *));
+	if (r.failed || devices == NULL) {
+		rc = -1;
+		goto out;
+	}
+
+	for (index = 0; index < count; index++) {
+		path = trace_get_string(&r);
+		name = trace_get_string(&r);
+		if (r.failed || create(&d, path) < 0) {
+			free(path);
+			free(name);
+			rc = -1;
+			goto out;
+		}
+		append(head, &tail, d);
+		devices[index] = d;
+
+		d->device = libevdev_new();
+		libevdev_set_name(d->device, name);
+		free(path);
+		free(name);
+
+		rc = trace_get_capabilities(&r, d->device);
+		if (rc < 0) {
+			goto out;
+		}
+
+		// the state last relayed is kept for the resyncs in the trace, see `replay_resync()`
+		rc = shadow_init(d);
+		if (rc < 0) {
+			goto out;
+		}
+
+		rc = create_targets(d, options->target_count);
+		if (rc < 0) {
+			goto out;
+		}
+
+		for (unsigned int i = 0; i < options->target_count; i++) {
+			rc = initialize_target(d, options, i);
+			if (rc < 0) {
+				goto out;
+			}
+		}
+	}
+
+	router.head = *head;
+
+	// the first record is relative to the start of the recording
+	base_us = trace_get_varint(&r);
+	trace_us = base_us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	start_us = now.tv_sec * 1000000L + now.tv_nsec / 1000;
+
+	rc = 0;
+	memset(&ev, 0, sizeof(ev));
+
+	while (r.p < r.end) {
+		if (trace_get_event(&r, &trace_us, &index, &ev) < 0 || index >= count) {
+			fprintf(stderr, "truncated or corrupt trace\n");
+			rc = -1;
+			break;
+		}
+
+		if (!options->replay_fast) {
+			sleep_until_us(start_us + trace_us - base_us);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		now_us = now.tv_sec * 1000000L + now.tv_nsec / 1000;
+		ev.input_event_sec = now_us / 1000000L;
+		ev.input_event_usec = now_us % 1000000L;
+
+		rc = hotkey_expire(*head, options, &router, now_us);
+		if (rc < 0) {
+			break;
+		}
+
+		if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+			devices[index]->syn_dropped++;
+			rc = replay_resync(devices[index], options, &router, &r, &trace_us, index, &ev);
+			if (rc == -EPROTO) {
+				fprintf(stderr, "truncated or corrupt trace\n");
+			}
+		} else {
+			rc = switch_and_relay_event(devices[index], options, &router, &ev);
+		}
+		if (rc < 0) {
+			break;
+		}
+
+		// every replayed event is an iteration of the event loop of its own
+		rc = switch_apply(&router, options);
+		if (rc < 0) {
+			break;
+		}
+	}
+
+out:
+	free(devices);
+	munmap(data, st.st_size);
+
+	return rc;
+}
+
+/**
+ * Find the CPU that serviced most interrupts of the USB host controllers.
+ */
+int usb_irq_cpu(int *irq) {
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0;
+	int cpus = 0, cpu = -1, n;
+	unsigned long count, max = 0;
+	char *p, *end;
+
+	f = fopen("/proc/interrupts", "r");
+	if (f == NULL) {
+		return -1;
+	}
+
+	// the header line has a column per CPU
+	if (getline(&line, &size, f) > 0) {
+		for (p = strtok(line, " \t\n"); p != NULL; p = strtok(NULL, " \t\n")) {
+			cpus++;
+		}
+	}
+
+	while (getline(&line, &size, f) > 0) {
+		if (strstr(line, "xhci_hcd") == NULL && strstr(line, "ehci_hcd") == NULL) {
+			continue;
+		}
+
+		n = strtol(line, &p, 10);
+		if (*p != ':') {
+			continue;
+		}
+		p++;
+
+		for (int i = 0; i < cpus; i++) {
+			count = strtoul(p, &end, 10);
+			if (end == p) {
+				break;
+			}
+			p = end;
+
+			if (count > max) {
+				max = count;
+				cpu = i;
+				*irq = n;
+			}
+		}
+	}
+
+	free(line);
+	fclose(f);
+
+	return cpu;
+}
+
+/**
+ * Touch the stack so the relay loop never takes a page fault on it.
+ */
+void __attribute__ ((noinline)) prefault_stack() {
+	volatile unsigned char stack[PREFAULT_STACK_SIZE];
+
+	for (size_t i = 0; i < sizeof(stack); i += sysconf(_SC_PAGESIZE)) {
+		stack[i] = 0;
+	}
+}
+
+/**
+ * Apply the realtime options and report which of them took effect.
+ *
+ * Failures are reported but not fatal, the relay still works without them.
+ */
+void enter_realtime(struct Options *options) {
+	int rc, cpu = options->cpu, irq = -1;
+	struct sched_param param = { .sched_priority = options->priority };
+	cpu_set_t set;
+
+	if (options->realtime) {
+		// keep freed memory in the process so it stays locked and faulted in
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+
+		rc = mlockall(MCL_CURRENT|MCL_FUTURE);
+		printf("realtime: mlockall %s\n", rc < 0 ? strerror(errno) : "ok");
+
+		prefault_stack();
+		printf("realtime: prefaulted %d KiB of stack\n", PREFAULT_STACK_SIZE / 1024);
+
+		rc = sched_setscheduler(0, SCHED_FIFO, &param);
+		if (rc < 0) {
+			printf("realtime: SCHED_FIFO priority %d %s\n", options->priority, strerror(errno));
+		} else {
+			rc = sched_getscheduler(0);
+			sched_getparam(0, &param);
+			printf("realtime: SCHED_FIFO priority %d %s\n",
+				param.sched_priority,
+				rc == SCHED_FIFO ? "ok" : "not in effect");
+		}
+	}
+
+	if (options->cpu_usb) {
+		cpu = usb_irq_cpu(&irq);
+		if (cpu < 0) {
+			printf("realtime: no USB controller interrupt found, not pinning\n");
+			return;
+		}
+		printf("realtime: USB controller interrupt %d is serviced by CPU %d\n", irq, cpu);
+	}
+
+	if (cpu < 0) {
+		return;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	rc = sched_setaffinity(0, sizeof(set), &set);
+	if (rc < 0) {
+		printf("realtime: pinning to CPU %d %s\n", cpu, strerror(errno));
+		return;
+	}
+
+	sched_getaffinity(0, sizeof(set), &set);
+	printf("realtime: pinning to CPU %d %s\n", cpu, CPU_ISSET(cpu, &set) && CPU_COUNT(&set) == 1 ? "ok" : "not in effect");
+}
+
+int block_signals(int epfd) {
+	int rc, signal_fd;
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+
+	signal_fd = signalfd(-1, &mask, 0);
+	if (signal_fd == -1) {
+		fprintf(stderr, "failed to create signal file descriptor\n");
+		return -1;
+	}
+
+	rc = sigprocmask(SIG_BLOCK, &mask, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "failed to create sigprocmask\n");
+		close(signal_fd);
+		return rc;
+	}
+
+	rc = epoll_add(epfd, signal_fd, NULL);
+	if (rc < 0) {
+		fprintf(stderr, "failed to add signal file descriptor to epoll\n");
+		close(signal_fd);
+		return rc;
+	}
+
+	return signal_fd;
+}
+
+void print_statistics(struct Device *head, struct Options *options) {
+	struct Device *d;
+	struct DeviceTarget *t;
+	unsigned long saved = 0;
+
+	for (d = head; d != NULL; d = d->next) {
+		if (d->syn_dropped > 0) {
+			printf("%s: %lu SYN_DROPPED, %lu resyncs, %.1fus on average, %.1fus at most\n",
+				d->device_path,
+				d->syn_dropped,
+				d->resyncs,
+				d->resyncs > 0 ? d->resync_ns / d->resyncs / 1000.0 : 0.0,
+				d->resync_ns_max / 1000.0);
+		}
+
+		for (unsigned int i = 0; i < d->target_count; i++) {
+			t = device_target(d, i);
+			printf("%s %s: %lu frames written, %lu write syscalls saved\n",
+				d->device_path,
+				target_label(options, i),
+				t->frames_written,
+				t->syscalls_saved);
+
+			printf("%s %s: %lu frames dropped, %lu frames misrouted, %lu write errors, %lu events queued at most\n",
+				d->device_path,
+				target_label(options, i),
+				t->frames_dropped,
+				t->frames_misrouted,
+				t->write_errors,
+				t->queue_high);
+
+			if (options->coalesce) {
+				printf("%s %s: %lu frames coalesced\n",
+					d->device_path,
+					target_label(options, i),
+					t->frames_coalesced);
+			}
+			saved += t->syscalls_saved;
+		}
+	}
+
+	printf("write syscalls saved: %lu\n", saved);
+}
+
+void print_latency(struct Device *head, struct Options *options) {
+	struct Device *d;
+	char label[256];
+
+	for (d = head; d != NULL; d = d->next) {
+		for (unsigned int i = 0; i < d->target_count; i++) {
+			histogram_print(device_target(d, i)->latency, d->device_path, target_label(options, i));
+		}
+	}
+
+	// from the trigger of a switch to the first frame of each device on the new target
+	for (d = head; d != NULL; d = d->next) {
+		for (unsigned int i = 0; i < d->target_count; i++) {
+			if (device_target(d, i)->switch_latency->count > 0) {
+				snprintf(label, sizeof(label), "%s after switch", target_label(options, i));
+				histogram_print(device_target(d, i)->switch_latency, d->device_path, label);
+			}
+		}
+	}
+
+	fflush(stdout);
+}
+
+void cleanup(struct Device *head, int *epfd, int *signal_fd) {
+	// before anything taken over is closed, see `takeover_refuse()`
+	takeover_refuse();
+
+	log_close();
+	trace_close();
+	control_close();
+	tap_close();
+
+	if (uring.fd != -1) {
+		close(uring.fd);
+	}
+
+	free_all_devices(head);
+
+	if (!(*epfd < 0)) {
+		close(*epfd);
+		*epfd = -1;
+	}
+
+	if (!(*signal_fd < 0)) {
+		close(*signal_fd);
+		*signal_fd = -1;
+	}
+}
+
+int target_index(struct Options *options, char *name) {
+	for (unsigned int i = 0; i < options->target_count; i++) {
+		if (strcmp(options->target_names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int hotkey_add(struct Hotkey *h) {
+	if (hotkeys.count == MAX_HOTKEYS) {
+		fprintf(stderr, "at most %d hotkeys are supported\n", MAX_HOTKEYS);
+		return -1;
+	}
+
+	hotkeys.triggers[h->code] |= 1U << hotkeys.count;
+	hotkeys.hotkeys[hotkeys.count++] = *h;
+
+	return 0;
+}
+
+int hotkey_parse_key(unsigned int *code, char *name) {
+	if (key_code_parse(code, name) < 0 || *code > KEY_MAX) {
+		fprintf(stderr, "%s is not a key name or key code\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a hotkey specification `[!][MODIFIER+...]KEY[:tap|:double]`.
+ */
+int hotkey_parse(struct Hotkey *h, char *spec) {
+	char *mode, *key, *plus;
+
+	memset(h, 0, sizeof(struct Hotkey));
+
+	if (*spec == '!') {
+		h->swallow = true;
+		spec++;
+	}
+
+	h->mode = hotkey_mode_press;
+
+	mode = strchr(spec, ':');
+	if (mode != NULL) {
+		*mode++ = '\0';
+
+		if (strcmp(mode, "tap") == 0) {
+			h->mode = hotkey_mode_tap;
+		} else if (strcmp(mode, "double") == 0) {
+			h->mode = hotkey_mode_double;
+		} else {
+			fprintf(stderr, "%s is not a hotkey mode\n", mode);
+			return -1;
+		}
+	}
+
+	for (key = spec; (plus = strchr(key, '+')) != NULL; key = plus + 1) {
+		*plus = '\0';
+
+		if (h->modifier_count == HOTKEY_MAX_MODIFIERS) {
+			fprintf(stderr, "at most %d modifiers are supported\n", HOTKEY_MAX_MODIFIERS);
+			return -1;
+		}
+
+		if (hotkey_parse_key(&h->modifiers[h->modifier_count++], key) < 0) {
+			return -1;
+		}
+	}
+
+	return hotkey_parse_key(&h->code, key);
+}
+
+/**
+ * Compile the `ACTION=SPEC` hotkeys, the switch key and the jump keys into `hotkeys`.
+ */
+int hotkey_compile(struct Options *options) {
+	struct Hotkey h;
+	char *separator;
+	bool next = false;
+
+	for (unsigned int i = 0; i < options->hotkey_count; i++) {
+		separator = strchr(options->hotkey_specs[i], '=');
+		if (separator == NULL) {
+			fprintf(stderr, "%s is not of the form ACTION=SPEC\n", options->hotkey_specs[i]);
+			return -1;
+		}
+
+		*separator = '\0';
+
+		if (hotkey_parse(&h, separator + 1) < 0) {
+			return -1;
+		}
+
+		if (strcmp(options->hotkey_specs[i], "next") == 0) {
+			h.target = -1;
+			next = true;
+		} else {
+			h.target = target_index(options, options->hotkey_specs[i]);
+			if (h.target < 0) {
+				fprintf(stderr, "%s is not a target\n", options->hotkey_specs[i]);
+				return -1;
+			}
+		}
+
+		if (hotkey_add(&h) < 0) {
+			return -1;
+		}
+	}
+
+	if (!next) {
+		memset(&h, 0, sizeof(h));
+		h.code = options->key_code;
+		h.target = -1;
+
+		if (hotkey_add(&h) < 0) {
+			return -1;
+		}
+	}
+
+	for (unsigned int i = 0; i < options->target_count; i++) {
+		if (options->jump_key_codes[i] == KEY_RESERVED) {
+			continue;
+		}
+
+		memset(&h, 0, sizeof(h));
+		h.code = options->jump_key_codes[i];
+		h.target = i;
+
+		if (hotkey_add(&h) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int transform_parse_code(unsigned int type, unsigned int *code, char *name) {
+	int c;
+
+	// key names are looked up in `key_codes` first, buttons and axes through libevdev
+	if (type == EV_KEY && key_code_parse(code, name) == 0 && *code <= KEY_MAX) {
+		return 0;
+	}
 
-			free(d);
-			d = NULL;
-		} while (head != NULL);
+	c = libevdev_event_code_from_name(type, name);
+	if (c < 0) {
+		fprintf(stderr, "%s is not a %s name\n", name, type == EV_KEY ? "key or button" : "relative axis");
+		return -1;
 	}
+
+	*code = c;
+
+	return 0;
 }
 
-int block_signals(int epfd) {
-	int rc, signal_fd;
-	sigset_t mask;
+int transform_parse_scale(struct Transform *tf, unsigned int code, char *factor) {
+	char *end;
+	double f = strtod(factor, &end);
 
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGINT);
-	sigaddset(&mask, SIGTERM);
+	if (end == factor || *end != '\0') {
+		fprintf(stderr, "%s is not a factor\n", factor);
+		return -1;
+	}
 
-	signal_fd = signalfd(-1, &mask, 0);
-	if (signal_fd == -1) {
-		fprintf(stderr, "failed to create signal file descriptor\n");
+	tf->rel_scale[code] = (int) (f * TRANSFORM_ONE + (f < 0 ? -0.5 : 0.5));
+
+	return 0;
+}
+
+/**
+ * Parse a map rule `KEY=KEY`, `KEY<>KEY`, `REL_AXIS*FACTOR` or `scroll*FACTOR`.
+ */
+int transform_parse_rule(struct Transform *tf, char *rule) {
+	unsigned int from, to;
+	char *separator;
+
+	if ((separator = strstr(rule, "<>")) != NULL) {
+		*separator = '\0';
+
+		if (transform_parse_code(EV_KEY, &from, rule) < 0 || transform_parse_code(EV_KEY, &to, separator + 2) < 0) {
+			return -1;
+		}
+
+		tf->keys[from] = to;
+		tf->keys[to] = from;
+	} else if ((separator = strchr(rule, '=')) != NULL) {
+		*separator = '\0';
+
+		if (transform_parse_code(EV_KEY, &from, rule) < 0 || transform_parse_code(EV_KEY, &to, separator + 1) < 0) {
+			return -1;
+		}
+
+		tf->keys[from] = to;
+	} else if ((separator = strchr(rule, '*')) != NULL) {
+		*separator = '\0';
+
+		if (strcmp(rule, "scroll") == 0) {
+			if (transform_parse_scale(tf, REL_WHEEL, separator + 1) < 0) {
+				return -1;
+			}
+
+			tf->rel_scale[REL_HWHEEL] = tf->rel_scale[REL_WHEEL];
+#ifdef REL_WHEEL_HI_RES
+			tf->rel_scale[REL_WHEEL_HI_RES] = tf->rel_scale[REL_WHEEL];
+			tf->rel_scale[REL_HWHEEL_HI_RES] = tf->rel_scale[REL_WHEEL];
+#endif
+		} else if (transform_parse_code(EV_REL, &from, rule) < 0 || transform_parse_scale(tf, from, separator + 1) < 0) {
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "%s is not a map rule\n", rule);
 		return -1;
 	}
 
-	rc = sigprocmask(SIG_BLOCK, &mask, NULL);
-	if (rc < 0) {
-		fprintf(stderr, "failed to create sigprocmask\n");
-		close(signal_fd);
-		return rc;
+	return 0;
+}
+
+/**
+ * Compile the `TARGET:RULE[,RULE...]` map specifications into `transforms`.
+ */
+int transform_compile(struct Options *options) {
+	int target;
+	char *separator, *rule, *next;
+	struct Transform *tf;
+
+	for (unsigned int i = 0; i < options->target_count; i++) {
+		for (unsigned int code = 0; code < KEY_CNT; code++) {
+			transforms[i].keys[code] = code;
+		}
+
+		for (unsigned int code = 0; code < REL_CNT; code++) {
+			transforms[i].rel_scale[code] = TRANSFORM_ONE;
+		}
 	}
 
-	rc = epoll_add(epfd, signal_fd, NULL);
-	if (rc < 0) {
-		fprintf(stderr, "failed to add signal file descriptor to epoll\n");
-		close(signal_fd);
-		return rc;
+	for (unsigned int i = 0; i < options->map_count; i++) {
+		separator = strchr(options->map_specs[i], ':');
+		if (separator == NULL) {
+			fprintf(stderr, "%s is not of the form TARGET:RULE[,RULE...]\n", options->map_specs[i]);
+			return -1;
+		}
+
+		*separator = '\0';
+
+		target = target_index(options, options->map_specs[i]);
+		if (target < 0) {
+			fprintf(stderr, "%s is not a target\n", options->map_specs[i]);
+			return -1;
+		}
+
+		tf = &transforms[target];
+		tf->active = true;
+
+		for (rule = separator + 1; rule != NULL; rule = next) {
+			next = strchr(rule, ',');
+			if (next != NULL) {
+				*next++ = '\0';
+			}
+
+			if (transform_parse_rule(tf, rule) < 0) {
+				return -1;
+			}
+		}
 	}
 
-	return signal_fd;
+	return 0;
 }
 
-void cleanup(struct Device *head, int *epfd, int *signal_fd) {
-	free_all_devices(head);
+/**
+ * Apply the default targets and resolve the `NAME=KEY` jump specifications once all
+ * targets are known.
+ */
+int resolve_targets(struct Options *options) {
+	int target;
+	unsigned int code;
+	char *separator;
 
-	if (!(*epfd < 0)) {
-		close(*epfd);
-		*epfd = -1;
+	if (options->target_count == 0) {
+		options->target_names[options->target_count++] = label_host;
+		options->target_names[options->target_count++] = label_guest;
 	}
 
-	if (!(*signal_fd < 0)) {
-		close(*signal_fd);
-		*signal_fd = -1;
+	for (unsigned int i = 0; i < options->jump_count; i++) {
+		separator = strchr(options->jump_specs[i], '=');
+		if (separator == NULL) {
+			fprintf(stderr, "%s is not of the form NAME=KEY\n", options->jump_specs[i]);
+			return -1;
+		}
+
+		*separator = '\0';
+
+		target = target_index(options, options->jump_specs[i]);
+		if (target < 0) {
+			fprintf(stderr, "%s is not a target\n", options->jump_specs[i]);
+			return -1;
+		}
+
+		if (key_code_parse(&code, separator + 1) < 0) {
+			fprintf(stderr, "%s is not a key name or key code\n", separator + 1);
+			return -1;
+		}
+
+		options->jump_key_codes[target] = code;
+	}
+
+	for (unsigned int i = 0; i < options->vhost_count; i++) {
+		separator = strchr(options->vhost_specs[i], ':');
+		if (separator == NULL) {
+			fprintf(stderr, "%s is not of the form TARGET:DIR\n", options->vhost_specs[i]);
+			return -1;
+		}
+
+		*separator = '\0';
+
+		target = target_index(options, options->vhost_specs[i]);
+		if (target < 0) {
+			fprintf(stderr, "%s is not a target\n", options->vhost_specs[i]);
+			return -1;
+		}
+
+		options->vhost_dirs[target] = separator + 1;
 	}
+
+	if (hotkey_compile(options) < 0) {
+		return -1;
+	}
+
+	return transform_compile(options);
 }
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -591,6 +6641,90 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 		case 'n':
 			arguments->options.no_symlink = true;
 			break;
+		case 'r':
+			arguments->options.raw_read = true;
+			break;
+		case 'l':
+			arguments->options.latency = true;
+			break;
+		case option_record:
+			arguments->options.record_path = arg;
+			break;
+		case option_replay:
+			arguments->options.replay_path = arg;
+			break;
+		case option_replay_fast:
+			arguments->options.replay_fast = true;
+			break;
+		case option_busy_poll:
+			arguments->options.busy_poll = true;
+			if (arg != NULL) {
+				arguments->options.busy_poll_window = strtol(arg, NULL, 10);
+				if (arguments->options.busy_poll_window <= 0) {
+					argp_error(state, "%s is not a valid busy poll window", arg);
+				}
+			}
+			break;
+		case option_coalesce:
+			arguments->options.coalesce = true;
+			break;
+		case option_motion_rate:
+			arguments->options.coalesce = true;
+			arguments->options.motion_rate = strtol(arg, NULL, 10);
+			if (arguments->options.motion_rate <= 0 || arguments->options.motion_rate > 100000) {
+				argp_error(state, "%s is not a valid motion rate", arg);
+			}
+			break;
+		case option_queue_policy:
+			if (strcmp(arg, "drop-new") == 0) {
+				arguments->options.drop_new = true;
+			} else if (strcmp(arg, "drop-old") == 0) {
+				arguments->options.drop_new = false;
+			} else {
+				argp_error(state, "%s is not a queue policy", arg);
+			}
+			break;
+		case option_control:
+			arguments->options.control_path = arg;
+			break;
+		case option_takeover:
+			arguments->options.takeover = true;
+			break;
+		case option_vhost_user:
+			if (arguments->options.vhost_count == MAX_TARGETS) {
+				argp_error(state, "at most %d vhost-user targets are supported", MAX_TARGETS);
+			}
+			arguments->options.vhost_specs[arguments->options.vhost_count++] = arg;
+			break;
+		case option_tap:
+			arguments->options.tap_capacity = arg != NULL ? strtoul(arg, NULL, 10) : TAP_CAPACITY;
+			if (arguments->options.tap_capacity == 0 || arguments->options.tap_capacity > TAP_MAX_CAPACITY
+					|| (arguments->options.tap_capacity & (arguments->options.tap_capacity - 1)) != 0) {
+				argp_error(state, "%s is not a power of two up to %d", arg, TAP_MAX_CAPACITY);
+			}
+			break;
+		case option_io_uring:
+			arguments->options.io_uring = true;
+			break;
+		case option_realtime:
+			arguments->options.realtime = true;
+			if (arg != NULL) {
+				arguments->options.priority = strtol(arg, NULL, 10);
+				if (arguments->options.priority < sched_get_priority_min(SCHED_FIFO)
+						|| arguments->options.priority > sched_get_priority_max(SCHED_FIFO)) {
+					argp_error(state, "%s is not a valid SCHED_FIFO priority", arg);
+				}
+			}
+			break;
+		case option_cpu:
+			if (strcmp(arg, "usb") == 0) {
+				arguments->options.cpu_usb = true;
+			} else if (is_only_digit(arg)) {
+				arguments->options.cpu = strtol(arg, NULL, 10);
+			} else {
+				argp_error(state, "%s is not a CPU", arg);
+			}
+			break;
 		case 'u':
 			rc = uid_from_string(&(arguments->options.uid), arg);
 			if (rc < 0) {
@@ -612,6 +6746,39 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 			}
 			arguments->options.key_code = code;
 			break;
+		case 't':
+			if (arguments->options.target_count == MAX_TARGETS) {
+				argp_error(state, "at most %d targets are supported", MAX_TARGETS);
+			}
+			if (target_index(&arguments->options, arg) >= 0) {
+				argp_error(state, "target %s is given twice", arg);
+			}
+			arguments->options.target_names[arguments->options.target_count++] = arg;
+			break;
+		case 'j':
+			if (arguments->options.jump_count == MAX_TARGETS) {
+				argp_error(state, "at most %d jump keys are supported", MAX_TARGETS);
+			}
+			arguments->options.jump_specs[arguments->options.jump_count++] = arg;
+			break;
+		case 'm':
+			if (arguments->options.map_count == MAX_MAPS) {
+				argp_error(state, "at most %d maps are supported", MAX_MAPS);
+			}
+			arguments->options.map_specs[arguments->options.map_count++] = arg;
+			break;
+		case 'k':
+			if (arguments->options.hotkey_count == MAX_HOTKEYS) {
+				argp_error(state, "at most %d hotkeys are supported", MAX_HOTKEYS);
+			}
+			arguments->options.hotkey_specs[arguments->options.hotkey_count++] = arg;
+			break;
+		case ARGP_KEY_END:
+			rc = resolve_targets(&arguments->options);
+			if (rc < 0) {
+				argp_error(state, "invalid jump key, hotkey, map or vhost-user target");
+			}
+			break;
 		case ARGP_KEY_ARG:
 			struct Device *d;
 
@@ -627,7 +6794,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 				break;
 			}
 
-			append(&(arguments->head), d);
+			append(&(arguments->head), &(arguments->tail), d);
 			break;
 	}
 
@@ -641,30 +6808,97 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 static struct argp argp = { options, parse_opt, args_doc, doc };
 
 int main(int argc, char **argv) {
-	int rc, epfd = -1, signal_fd = -1, nfds, n;
+	int rc, epfd = -1, signal_fd = -1, inotify_fd = -1, motion_fd = -1, hotkey_fd = -1, nfds, n;
+	uint64_t ticks;
 	struct arguments arguments;
 	struct Device *head, *d;
 	struct Options options;
 	struct epoll_event events[MAX_EVENTS];
-	enum TARGET target = initialized;
+	struct signalfd_siginfo siginfo;
+	struct timespec now;
+	struct Router router = { .target = 0, .switched = false, .head = NULL, .pending = -1, .pending_from = -1, .switches = 0 };
 
 	arguments.head = NULL;
+	arguments.tail = NULL;
 	arguments.options.verbose = false;
 	arguments.options.grab = false;
 	arguments.options.no_symlink = false;
 	arguments.options.is_uid_set = false;
+	arguments.options.raw_read = false;
+	arguments.options.latency = false;
+	arguments.options.replay_fast = false;
+	arguments.options.io_uring = false;
+	arguments.options.busy_poll = false;
+	arguments.options.busy_poll_window = BUSY_POLL_WINDOW;
+	arguments.options.coalesce = false;
+	arguments.options.motion_rate = 0;
+	arguments.options.drop_new = false;
+	arguments.options.control_path = NULL;
+	arguments.options.takeover = false;
+	arguments.options.tap_capacity = 0;
+	arguments.options.vhost_count = 0;
+	memset(arguments.options.vhost_dirs, 0, sizeof(arguments.options.vhost_dirs));
+	arguments.options.realtime = false;
+	arguments.options.priority = REALTIME_PRIORITY;
+	arguments.options.cpu = -1;
+	arguments.options.cpu_usb = false;
+	arguments.options.record_path = NULL;
+	arguments.options.replay_path = NULL;
 	arguments.options.key_code = KEY_RIGHTSHIFT;
+	arguments.options.target_count = 0;
+	arguments.options.jump_count = 0;
+	arguments.options.hotkey_count = 0;
+	arguments.options.map_count = 0;
+	memset(arguments.options.jump_key_codes, 0, sizeof(arguments.options.jump_key_codes));
 
 	argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
 	head = arguments.head;
 	options = arguments.options;
+	router.head = head;
 
 	if (options.verbose) {
 		const struct KeyCode *key_code = key_code_by_code(options.key_code);
 		printf("Switch key: %s\n", key_code->key);
 	}
 
+	if (options.replay_path != NULL) {
+		// replayed devices have no file descriptor to grab or read through io_uring
+		options.grab = false;
+		options.io_uring = false;
+		options.busy_poll = false;
+		options.control_path = NULL;
+		options.takeover = false;
+		options.tap_capacity = 0;
+		memset(options.vhost_dirs, 0, sizeof(options.vhost_dirs));
+
+		// replay relays every frame as it was recorded
+		options.coalesce = false;
+		options.motion_rate = 0;
+
+		if (options.verbose && log_open(&options) < 0) {
+			cleanup(head, &epfd, &signal_fd);
+			exit(1);
+		}
+
+		enter_realtime(&options);
+
+		rc = replay(&head, &options);
+
+		log_close();
+
+		if (options.verbose) {
+			print_statistics(head, &options);
+		}
+
+		if (options.latency) {
+			print_latency(head, &options);
+		}
+
+		cleanup(head, &epfd, &signal_fd);
+		exit(rc < 0 ? 1 : 0);
+	}
+
 	if (head != NULL) {
 
 		epfd = epoll_create1(0);
@@ -673,20 +6907,130 @@ int main(int argc, char **argv) {
 			cleanup(arguments.head,  &epfd, &signal_fd);
 		};
 
+		output_epfd = epfd;
+
+		if (device_table_build(&head) < 0) {
+			fprintf(stderr, "failed to allocate the device table\n");
+			cleanup(head, &epfd, &signal_fd);
+			exit(1);
+		}
+		router.head = head;
+
 		for (d = head; d != NULL; d = d->next) {
 			if (!is_valid(d)) { 
 				fprintf(stderr, "device %s is invalid\n", d->device_path);
 				cleanup(head, &epfd, &signal_fd);
 				exit(1);
 			}
+		}
+
+		if (options.takeover) {
+			if (options.control_path == NULL) {
+				fprintf(stderr, "the devices are taken over on the control socket, --takeover needs --control\n");
+				cleanup(head, &epfd, &signal_fd);
+				exit(1);
+			}
+
+			rc = takeover(head, &options, &router);
+			if (rc < 0) {
+				fprintf(stderr, "failed to take over from %s (%d)\n", options.control_path, rc);
+				cleanup(head, &epfd, &signal_fd);
+				exit(1);
+			}
+		}
+
+		if (options.io_uring && options.busy_poll) {
+			fprintf(stderr, "busy polling is not supported with io_uring, ignoring it\n");
+			options.busy_poll = false;
+		}
+
+		if (options.io_uring) {
+			rc = uring_create(device_table.count, options.target_count);
+			if (rc < 0) {
+				fprintf(stderr, "failed to create io_uring (%d), falling back to epoll\n", rc);
+				options.io_uring = false;
+			}
+		}
+
+		if (initialize_all(head, &options, epfd) < 0) {
+			cleanup(head,  &epfd, &signal_fd);
+			exit(1);
+		}
+
+		if (options.io_uring && uring_register(&router, &options, epfd) < 0) {
+			fprintf(stderr, "failed to register devices with io_uring\n");
+			cleanup(head, &epfd, &signal_fd);
+			exit(1);
+		}
+
+		if (options.record_path != NULL && trace_open(head, options.record_path,
+				monotonic_clock(&options) ? CLOCK_MONOTONIC : CLOCK_REALTIME) < 0) {
+			cleanup(head, &epfd, &signal_fd);
+			exit(1);
+		}
+
+		inotify_fd = watch_devices(head, epfd);
+		if (inotify_fd < 0) {
+			fprintf(stderr, "failed to watch devices, hotplug is disabled\n");
+		}
+
+		if (options.control_path != NULL) {
+			rc = control_open(options.control_path, epfd);
+			if (rc < 0) {
+				fprintf(stderr, "failed to open control socket %s (%d)\n", options.control_path, rc);
+				cleanup(head, &epfd, &signal_fd);
+				exit(1);
+			}
+		}
+
+		if (options.tap_capacity > 0) {
+			if (options.control_path == NULL) {
+				fprintf(stderr, "the tap is handed out on the control socket, --tap needs --control\n");
+				cleanup(head, &epfd, &signal_fd);
+				exit(1);
+			}
+
+			rc = tap_open(&options);
+			if (rc < 0) {
+				fprintf(stderr, "failed to create tap (%d)\n", rc);
+				cleanup(head, &epfd, &signal_fd);
+				exit(1);
+			}
+		}
+
+		if (options.motion_rate > 0) {
+			motion_fd = motion_timer(epfd, options.motion_rate);
+			if (motion_fd < 0) {
+				fprintf(stderr, "failed to create motion rate timer\n");
+				cleanup(head, &epfd, &signal_fd);
+				exit(1);
+			}
+		}
 
-			if (initialize(d, &options, epfd) < 0) {
-				fprintf(stderr, "device %s failed to initialize\n", d->device_path);
-				cleanup(head,  &epfd, &signal_fd);
+		if (hotkeys.count > 0) {
+			hotkey_fd = hotkey_timer(epfd);
+			if (hotkey_fd < 0) {
+				fprintf(stderr, "failed to create hotkey timer\n");
+				cleanup(head, &epfd, &signal_fd);
 				exit(1);
 			}
 		}
 
+		if (options.verbose && log_open(&options) < 0) {
+			cleanup(head, &epfd, &signal_fd);
+			exit(1);
+		}
+
+		// the previous instance exits once everything it handed over is adopted
+		rc = takeover_ack(&options, &router);
+		if (rc < 0) {
+			fprintf(stderr, "failed to acknowledge the takeover from %s (%d)\n", options.control_path, rc);
+			cleanup(head, &epfd, &signal_fd);
+			exit(1);
+		}
+
+		enter_realtime(&options);
+
 		signal_fd = block_signals(epfd);
 		if (signal_fd < 0) {
 			fprintf(stderr, "failed to adapt interrupt signal to epoll\n");
@@ -694,7 +7038,20 @@ int main(int argc, char **argv) {
 		}
 
 		while (true) {
-			nfds = epoll_wait(epfd, events, MAX_EVENTS, -1);
+			if (options.io_uring) {
+				rc = uring_run();
+				if (rc < 0) {
+					fprintf(stderr, "io_uring failure (%d)\n", rc);
+					cleanup(head, &epfd, &signal_fd);
+					exit(1);
+				}
+			}
+
+			nfds = epoll_wait(epfd, events, MAX_EVENTS, options.io_uring ? 0 : busy_poll_timeout(&options));
+
+			if (options.busy_poll) {
+				busy_poll_woken(events, nfds);
+			}
 
 			if (nfds == -1) {
 				fprintf(stderr, "epoll failure\n");
@@ -703,21 +7060,121 @@ int main(int argc, char **argv) {
 			}
 
 			for (n = 0; n < nfds; n++) {
+				// devices are looked up first, they are the bulk of the events
+				if (events[n].data.u64 & DEVICE_TAG) {
+					d = device_table_get(events[n].data.u64);
+					if (options.raw_read) {
+						rc = next_raw_events(d, &options, &router);
+					} else {
+						rc = next_events(d, &options, &router, LIBEVDEV_READ_FLAG_NORMAL);
+					}
+
+					if (rc == -ENODEV) {
+						detach(d, &options, epfd);
+					} else if (rc != -EAGAIN && rc < 0) {
+						fprintf(stderr, "failed next event processing with %d\n", rc);
+					}
+					continue;
+				}
+
 				if (events[n].data.fd == signal_fd) {
+					if (read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)
+							&& siginfo.ssi_signo == SIGUSR1) {
+						if (options.latency) {
+							print_latency(head, &options);
+						}
+
+						if (options.busy_poll) {
+							busy_poll_print(&options);
+						}
+						continue;
+					}
+
+					log_close();
+
+					if (options.verbose) {
+						print_statistics(head, &options);
+					}
+
+					if (options.latency) {
+						print_latency(head, &options);
+					}
+
+					if (options.busy_poll) {
+						busy_poll_print(&options);
+					}
+
 					cleanup(head, &epfd, &signal_fd);
 					exit(1);
 				}
 
 
-				if (events[n].data.ptr != NULL) {
-					d = (struct Device *) events[n].data.ptr;
-					rc = next_events(d, &options, &target, LIBEVDEV_READ_FLAG_NORMAL);
+				if (events[n].data.fd == inotify_fd) {
+					handle_hotplug(inotify_fd, &router, &options, epfd);
+					continue;
+				}
 
-					if (rc != -EAGAIN && rc < 0) {
-						fprintf(stderr, "failed next event processing with %d\n", rc);
+				if (events[n].data.fd == motion_fd) {
+					if (read(motion_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+						for (d = head; d != NULL; d = d->next) {
+							motion_flush_device(d, &options);
+						}
+					}
+					continue;
+				}
+
+				if (events[n].data.fd == hotkey_fd) {
+					if (read(hotkey_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+						clock_gettime(monotonic_clock(&options) ? CLOCK_MONOTONIC : CLOCK_REALTIME, &now);
+						rc = hotkey_expire(head, &options, &router, now.tv_sec * 1000000L + now.tv_nsec / 1000);
+						if (rc < 0) {
+							fprintf(stderr, "failed to relay held hotkey (%d)\n", rc);
+						}
+					}
+					continue;
+				}
+
+				if (events[n].data.fd == control.fd) {
+					control_accept(epfd);
+					continue;
+				}
+
+				if (events[n].data.fd == control.timer_fd) {
+					control_handoff_expire(epfd);
+					continue;
+				}
+
+				if (events[n].data.u64 & CONTROL_TAG) {
+					control_handle(events[n].data.u64 >> 32, &router, &options, epfd);
+
+					if (handed_off) {
+						log_close();
+
+						if (options.verbose) {
+							print_statistics(head, &options);
+						}
+
+						cleanup(head, &epfd, &signal_fd);
+						exit(0);
 					}
+					continue;
+				}
+
+				if (events[n].data.u64 & VHOST_TAG) {
+					vhost_handle((struct VhostUser *) (events[n].data.u64 & ~VHOST_TAG));
+					continue;
+				}
+
+				if (events[n].data.u64 & QUEUE_TAG) {
+					vhost_kicked((struct DeviceTarget *) (events[n].data.u64 & ~QUEUE_TAG), &options);
+					continue;
 				}
 			}
+
+			rc = switch_apply(&router, &options);
+			if (rc < 0) {
+				fprintf(stderr, "failed to switch target (%d)\n", rc);
+			}
 		}
 
 		cleanup(head, &epfd, &signal_fd);
@@ -0,0 +1,77 @@
+#ifndef EVDEVKM_HISTOGRAM_H
+#define EVDEVKM_HISTOGRAM_H
+
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Log-linear histogram of nanosecond values in the style of HdrHistogram.
+ *
+ * Each power of two is split into `HISTOGRAM_SUB_BUCKETS` linear buckets which
+ * keeps the relative error of a recorded value below 1/16.
+ */
+struct Histogram {
+	unsigned long counts[HISTOGRAM_BUCKETS];
+	unsigned long count;
+	unsigned long max;
+};
+
+static unsigned int histogram_index(unsigned long value) {
+	unsigned int shift;
+
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+
+	shift = 63 - __builtin_clzl(value) - HISTOGRAM_SUB_BUCKET_BITS;
+
+	return ((shift + 1) << HISTOGRAM_SUB_BUCKET_BITS) + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * Highest value that is recorded in the bucket at `index`.
+ */
+static unsigned long histogram_value(unsigned int index) {
+	unsigned int shift;
+	unsigned long sub;
+
+	if (index < HISTOGRAM_SUB_BUCKETS) {
+		return index;
+	}
+
+	shift = (index >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+	sub = index & (HISTOGRAM_SUB_BUCKETS - 1);
+
+	return (((HISTOGRAM_SUB_BUCKETS | sub) + 1) << shift) - 1;
+}
+
+static void histogram_record(struct Histogram *h, unsigned long value) {
+	h->counts[histogram_index(value)]++;
+	h->count++;
+
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+static unsigned long histogram_percentile(struct Histogram *h, double percentile) {
+	unsigned long n = 0, rank = (unsigned long) (percentile / 100.0 * h->count + 0.5);
+	unsigned long value;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		n += h->counts[i];
+		if (n >= rank) {
+			value = histogram_value(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef EVDEVKM_TAP_H
+#define EVDEVKM_TAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <linux/input.h>
+
+#define TAP_MAGIC 0x70617465U
+#define TAP_VERSION 2
+#define TAP_FRAME_LENGTH 64
+#define TAP_MAX_TARGETS 8
+#define TAP_NAME_LENGTH 32
+#define TAP_CACHE_LINE 64
+
+/**
+ * Shared memory tap of the relayed frames.
+ *
+ * evdevkm publishes every frame it writes to a target into a ring of slots in a
+ * memfd that is handed to consumers over the control socket. There is a single
+ * producer and any number of consumers which map the memfd read-only and never
+ * make a syscall to read. Frame `seq` is published to slot `seq % capacity`,
+ * guarded by a sequence lock: the slot sequence is odd while the slot is written
+ * and `2 * seq + 2` once frame `seq` is complete. A consumer that falls more than
+ * `capacity` frames behind loses frames, which it detects from the slot sequence,
+ * and never holds up the producer.
+ */
+struct TapHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t slot_size;
+	uint32_t target_count;
+	uint32_t reserved;
+	char targets[TAP_MAX_TARGETS][TAP_NAME_LENGTH];
+
+	// sequence of the next frame to be published
+	uint64_t head __attribute__((aligned(TAP_CACHE_LINE)));
+} __attribute__((aligned(TAP_CACHE_LINE)));
+
+struct TapSlot {
+	uint64_t seq;
+	uint32_t device;
+	uint16_t target;
+	// events in the slot, the first `TAP_FRAME_LENGTH` of the `frame_length` events
+	// of a longer frame
+	uint16_t length;
+	uint16_t frame_length;
+	struct input_event events[TAP_FRAME_LENGTH];
+} __attribute__((aligned(TAP_CACHE_LINE)));
+
+static inline size_t tap_size(uint32_t capacity) {
+	return sizeof(struct TapHeader) + (size_t) capacity * sizeof(struct TapSlot);
+}
+
+static inline struct TapSlot *tap_slot(struct TapHeader *tap, uint32_t capacity, uint64_t seq) {
+	return (struct TapSlot *) (tap + 1) + (seq & (capacity - 1));
+}
+
+static inline void tap_init(struct TapHeader *tap, uint32_t capacity) {
+	memset(tap, 0, tap_size(capacity));
+	tap->magic = TAP_MAGIC;
+	tap->version = TAP_VERSION;
+	tap->capacity = capacity;
+	tap->slot_size = sizeof(struct TapSlot);
+}
+
+/**
+ * Publish frame `seq`, only called by the producer.
+ *
+ * The producer keeps the sequence and the capacity to itself and never reads the
+ * header back, as a consumer may be able to write to the mapping, see `tap_open()`.
+ * A frame longer than `TAP_FRAME_LENGTH` is cut short and keeps its length in
+ * `frame_length`.
+ */
+static inline void tap_publish(struct TapHeader *tap, uint64_t seq, uint32_t capacity, uint32_t device,
+		uint16_t target, const struct input_event *events, size_t length) {
+	struct TapSlot *slot = tap_slot(tap, capacity, seq);
+
+	__atomic_store_n(&slot->seq, 2 * seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->device = device;
+	slot->target = target;
+	slot->frame_length = length;
+	slot->length = length < TAP_FRAME_LENGTH ? length : TAP_FRAME_LENGTH;
+	memcpy(slot->events, events, length * sizeof(struct input_event));
+
+	__atomic_store_n(&slot->seq, 2 * seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&tap->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+enum TAP_READ {
+	tap_read_empty,
+	tap_read_frame,
+	tap_read_lost
+};
+
+/**
+ * Copy frame `*seq` into `out` and advance `*seq`.
+ *
+ * If the frame has been overwritten `*seq` is moved to the oldest frame that is
+ * still available and `*lost` is increased by the number of frames skipped.
+ */
+static inline enum TAP_READ tap_read(struct TapHeader *tap, uint64_t *seq, struct TapSlot *out, uint64_t *lost) {
+	uint64_t head = __atomic_load_n(&tap->head, __ATOMIC_ACQUIRE);
+	uint64_t before, after;
+	struct TapSlot *slot;
+
+	if (*seq >= head) {
+		return tap_read_empty;
+	}
+
+	if (head - *seq > tap->capacity) {
+		*lost += head - tap->capacity - *seq;
+		*seq = head - tap->capacity;
+		return tap_read_lost;
+	}
+
+	slot = tap_slot(tap, tap->capacity, *seq);
+
+	before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (before != 2 * *seq + 2) {
+		// overwritten since `head` was read, retry from the new head
+		*lost += 1;
+		*seq += 1;
+		return tap_read_lost;
+	}
+
+	out->device = slot->device;
+	out->target = slot->target;
+	out->frame_length = slot->frame_length;
+	out->length = slot->length <= TAP_FRAME_LENGTH ? slot->length : TAP_FRAME_LENGTH;
+	memcpy(out->events, slot->events, out->length * sizeof(struct input_event));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	if (after != before) {
+		*lost += 1;
+		*seq += 1;
+		return tap_read_lost;
+	}
+
+	out->seq = *seq;
+	*seq += 1;
+
+	return tap_read_frame;
+}
+
+#endif
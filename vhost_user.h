@@ -0,0 +1,106 @@
+#ifndef EVDEVKM_VHOST_USER_H
+#define EVDEVKM_VHOST_USER_H
+
+#include <stdint.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_input.h>
+#include <linux/virtio_ring.h>
+
+/**
+ * The parts of the vhost-user protocol used by a virtio-input backend.
+ *
+ * Messages are a header followed by `size` bytes of payload on a unix stream
+ * socket, file descriptors are passed alongside the header with `SCM_RIGHTS`.
+ * See docs/interop/vhost-user.rst in QEMU.
+ */
+enum VHOST_USER_REQUEST {
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+	VHOST_USER_SET_VRING_ERR = 14,
+	VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+	VHOST_USER_GET_QUEUE_NUM = 17,
+	VHOST_USER_SET_VRING_ENABLE = 18,
+	VHOST_USER_GET_CONFIG = 24,
+	VHOST_USER_SET_CONFIG = 25
+};
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_REPLY_MASK (1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK (1 << 3)
+
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+
+// the file descriptor of a kick or call message is missing when this bit is set
+#define VHOST_USER_VRING_NOFD_MASK (1 << 8)
+#define VHOST_USER_VRING_INDEX_MASK 0xff
+
+#define VHOST_USER_MAX_REGIONS 8
+#define VHOST_USER_MAX_FDS 8
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+#define VHOST_USER_HEADER_SIZE 12
+
+// virtio-input has an event queue, device to driver, and a status queue
+#define VHOST_INPUT_EVENTQ 0
+#define VHOST_INPUT_STATUSQ 1
+#define VHOST_INPUT_QUEUES 2
+
+struct VhostUserVringState {
+	uint32_t index;
+	uint32_t num;
+};
+
+struct VhostUserVringAddr {
+	uint32_t index;
+	uint32_t flags;
+	uint64_t desc_user_addr;
+	uint64_t used_user_addr;
+	uint64_t avail_user_addr;
+	uint64_t log_guest_addr;
+};
+
+struct VhostUserRegion {
+	uint64_t guest_phys_addr;
+	uint64_t memory_size;
+	uint64_t userspace_addr;
+	uint64_t mmap_offset;
+};
+
+struct VhostUserMemory {
+	uint32_t nregions;
+	uint32_t padding;
+	struct VhostUserRegion regions[VHOST_USER_MAX_REGIONS];
+};
+
+struct VhostUserConfig {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t flags;
+	uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+};
+
+struct VhostUserMessage {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		struct VhostUserVringState state;
+		struct VhostUserVringAddr addr;
+		struct VhostUserMemory memory;
+		struct VhostUserConfig config;
+	} payload;
+} __attribute__((packed));
+
+#endif